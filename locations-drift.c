@@ -0,0 +1,361 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <account.h>
+#include <core.h>
+#include <signals.h>
+
+#include "locations-drift.h"
+#include "locations-model.h"
+#include "locations-set.h"
+
+/*
+ * Expected states are stored as pointers holding the recompute generation
+ * and the enabled bit, so they are never 0, which would read as "not
+ * recorded". Recomputing overwrites the entries in place and then drops
+ * those of older generations, instead of emptying and regrowing the table
+ * on every switch.
+ */
+#define STATE_NEW(enabled) GUINT_TO_POINTER(generation << 1 | ((enabled) ? 1 : 0))
+#define STATE_ENABLED(state) ((GPOINTER_TO_UINT(state) & 1) != 0)
+#define STATE_GENERATION(state) (GPOINTER_TO_UINT(state) >> 1)
+
+static int handle;
+
+static GHashTable *expected = NULL;	/* PurpleAccount -> STATE_* */
+static GHashTable *drifted = NULL;	/* Set of PurpleAccount */
+static gboolean switching = FALSE;
+static guint generation = 1;
+
+static void
+locations_drift_notify(gboolean was_modified)
+{
+	if (was_modified != (g_hash_table_size(drifted) > 0))
+		purple_signal_emit(&handle, "drift-changed");
+}
+
+static void
+locations_drift_update_account(PurpleAccount *account, gpointer state)
+{
+	gboolean enabled = FALSE;
+
+	enabled = purple_account_get_enabled(account, purple_core_get_ui());
+	if (enabled != STATE_ENABLED(state))
+		g_hash_table_insert(drifted, account, account);
+	else
+		g_hash_table_remove(drifted, account);
+}
+
+static void
+account_toggled_cb(PurpleAccount *account, gpointer data)
+{
+	gpointer state = NULL;
+	gboolean was_modified = FALSE;
+
+	if (switching)
+		return;
+
+	state = g_hash_table_lookup(expected, account);
+	if (state == NULL)
+		return;
+
+	was_modified = g_hash_table_size(drifted) > 0;
+	locations_drift_update_account(account, state);
+	locations_drift_notify(was_modified);
+}
+
+static void
+account_removed_cb(PurpleAccount *account, gpointer data)
+{
+	gboolean was_modified = FALSE;
+
+	was_modified = g_hash_table_size(drifted) > 0;
+	g_hash_table_remove(expected, account);
+	g_hash_table_remove(drifted, account);
+	locations_drift_notify(was_modified);
+}
+
+/* Editing a location of the active set changes what is expected. */
+static void
+location_changed_cb(void)
+{
+	locations_drift_recompute();
+}
+
+static void
+expect_account_cb(PurpleAccount *account, gboolean enabled, gpointer data)
+{
+	gpointer state = STATE_NEW(enabled);
+
+	g_hash_table_insert(expected, account, state);
+	locations_drift_update_account(account, state);
+}
+
+static gboolean
+expected_stale_cb(gpointer key, gpointer value, gpointer data)
+{
+	return STATE_GENERATION(value) != generation;
+}
+
+void
+locations_drift_init()
+{
+	void *accounts_handle = purple_accounts_get_handle();
+
+	expected = g_hash_table_new(g_direct_hash, g_direct_equal);
+	drifted = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	purple_signal_register(&handle, "drift-changed", purple_marshal_VOID, NULL, 0);
+
+	purple_signal_connect(accounts_handle, "account-enabled",
+			&handle, PURPLE_CALLBACK(account_toggled_cb), NULL);
+	purple_signal_connect(accounts_handle, "account-disabled",
+			&handle, PURPLE_CALLBACK(account_toggled_cb), NULL);
+	purple_signal_connect(accounts_handle, "account-removed",
+			&handle, PURPLE_CALLBACK(account_removed_cb), NULL);
+
+	purple_signal_connect(locations_model_get_handle(), "location-changed",
+			&handle, PURPLE_CALLBACK(location_changed_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "location-removed",
+			&handle, PURPLE_CALLBACK(location_changed_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "locations-reloaded",
+			&handle, PURPLE_CALLBACK(location_changed_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "locations-changed",
+			&handle, PURPLE_CALLBACK(location_changed_cb), NULL);
+
+	locations_drift_recompute();
+}
+
+void
+locations_drift_uninit()
+{
+	purple_signals_disconnect_by_handle(&handle);
+	purple_signals_unregister_by_instance(&handle);
+
+	g_hash_table_destroy(expected);
+	g_hash_table_destroy(drifted);
+	expected = NULL;
+	drifted = NULL;
+}
+
+void *
+locations_drift_get_handle()
+{
+	return &handle;
+}
+
+void
+locations_drift_recompute()
+{
+	gboolean was_modified = FALSE;
+
+	was_modified = g_hash_table_size(drifted) > 0;
+	g_hash_table_remove_all(drifted);
+
+	if (++generation > G_MAXUINT >> 1)
+		generation = 1;
+	if (locations_set_evaluate())
+		locations_set_foreach_account(expect_account_cb, NULL);
+	g_hash_table_foreach_remove(expected, expected_stale_cb, NULL);
+
+	locations_drift_notify(was_modified);
+}
+
+void
+locations_drift_begin_switch()
+{
+	switching = TRUE;
+}
+
+void
+locations_drift_end_switch()
+{
+	switching = FALSE;
+	locations_drift_recompute();
+}
+
+guint
+locations_drift_get_count()
+{
+	return g_hash_table_size(drifted);
+}
+
+GList *
+locations_drift_get_accounts()
+{
+	return g_hash_table_get_keys(drifted);
+}
+
+/* The state a location records for the account, or NULL. */
+static AccountStateInfo *
+locations_drift_layer_state(const gchar *location_name, PurpleAccount *account)
+{
+	GList *item = NULL;
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		if (((AccountStateInfo *)item->data)->account == account)
+			return (AccountStateInfo *)item->data;
+	}
+
+	return NULL;
+}
+
+/*
+ * The effective state of the account if the layer of location_name recorded
+ * enabled, folded bottom to top the way locations_set_evaluate() does.
+ */
+static gboolean
+locations_drift_fold(PurpleAccount *account, const gchar *location_name, gboolean enabled)
+{
+	GList *layer = NULL;
+	LocationsSetLayer *set_layer = NULL;
+	AccountStateInfo *asi = NULL;
+	gboolean state = FALSE,
+			 effective = FALSE,
+			 seen = FALSE;
+
+	for (layer = locations_set_get_layers(); layer != NULL; layer = g_list_next(layer))
+	{
+		set_layer = (LocationsSetLayer *)layer->data;
+		if ((asi = locations_drift_layer_state(set_layer->location_name, account)) == NULL)
+			continue;
+
+		state = strcmp(set_layer->location_name, location_name) == 0 ? enabled : asi->enabled;
+		switch (layer == locations_set_get_layers() ? LOCATIONS_SET_OVERRIDE : set_layer->op)
+		{
+			case LOCATIONS_SET_UNION:
+				effective = effective || state;
+				break;
+			case LOCATIONS_SET_INTERSECT:
+				effective = seen ? effective && state : state;
+				break;
+			case LOCATIONS_SET_OVERRIDE:
+				effective = state;
+				break;
+		}
+		seen = TRUE;
+	}
+
+	return effective;
+}
+
+static void
+locations_drift_queue_update(GHashTable *updates, const gchar *location_name,
+		PurpleAccount *account, gboolean enabled)
+{
+	GList *states = NULL;
+
+	states = (GList *)g_hash_table_lookup(updates, location_name);
+	states = g_list_prepend(states, account_state_info_new(account, enabled));
+	g_hash_table_insert(updates, (gpointer)location_name, states);
+}
+
+void
+locations_drift_save()
+{
+	GHashTable *updates = NULL;	/* location name -> list of AccountStateInfo */
+	GHashTableIter iter;
+	gpointer key = NULL,
+			 value = NULL;
+	GList *layer = NULL;
+	const gchar *location_name = NULL;
+	PurpleAccount *account = NULL;
+	gboolean enabled = FALSE,
+			 saved = FALSE;
+
+	/* One batched update per location rather than one per account */
+	updates = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_iter_init(&iter, drifted);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		account = (PurpleAccount *)key;
+		enabled = purple_account_get_enabled(account, purple_core_get_ui());
+
+		/* The topmost layer that alone brings the set to the live state */
+		saved = FALSE;
+		layer = g_list_last(locations_set_get_layers());
+		for (; layer != NULL && !saved; layer = g_list_previous(layer))
+		{
+			location_name = ((LocationsSetLayer *)layer->data)->location_name;
+			if (locations_drift_layer_state(location_name, account) != NULL &&
+					locations_drift_fold(account, location_name, enabled) == enabled)
+			{
+				locations_drift_queue_update(updates, location_name, account, enabled);
+				saved = TRUE;
+			}
+		}
+
+		/* Otherwise every layer recording it takes the live state. */
+		layer = g_list_first(locations_set_get_layers());
+		for (; layer != NULL && !saved; layer = g_list_next(layer))
+		{
+			location_name = ((LocationsSetLayer *)layer->data)->location_name;
+			if (locations_drift_layer_state(location_name, account) != NULL)
+				locations_drift_queue_update(updates, location_name, account, enabled);
+		}
+	}
+
+	locations_model_begin_batch();
+	g_hash_table_iter_init(&iter, updates);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		locations_model_update_accounts((gchar *)key, (GList *)value);
+		g_list_foreach((GList *)value, (GFunc)account_state_info_free, NULL);
+		g_list_free((GList *)value);
+	}
+	g_hash_table_destroy(updates);
+
+	/* Ending the batch recomputes the drift once, through location_changed_cb(). */
+	locations_model_end_batch();
+}
+
+void
+locations_drift_reapply()
+{
+	GList *accounts = NULL,
+		  *item = NULL;
+	PurpleAccount *account = NULL;
+	const gchar *ui = NULL;
+
+	ui = purple_core_get_ui();
+
+	/* Each change comes back through account_toggled_cb() and leaves the set. */
+	accounts = g_hash_table_get_keys(drifted);
+	for (item = accounts; item != NULL; item = g_list_next(item))
+	{
+		account = (PurpleAccount *)item->data;
+		purple_account_set_enabled(account, ui,
+				STATE_ENABLED(g_hash_table_lookup(expected, account)));
+	}
+	g_list_free(accounts);
+}
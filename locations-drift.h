@@ -0,0 +1,69 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Drift tracking: the accounts whose enabled state no longer matches the
+ * active location set, because they were enabled or disabled directly
+ * after the last switch.
+ */
+
+#ifndef _LOCATIONS_DRIFT_H_
+#define _LOCATIONS_DRIFT_H_
+
+#include <glib.h>
+
+/*
+ * Start listening to the account signals and compute the drift of the
+ * active set. The drift handle emits "drift-changed" (void) whenever the
+ * active set becomes modified or clean again.
+ */
+void locations_drift_init(void);
+void locations_drift_uninit(void);
+void *locations_drift_get_handle(void);
+
+/* Forget the drift and compare every account with the active set again. */
+void locations_drift_recompute(void);
+
+/* The switch engine brackets its changes, they are not drift. */
+void locations_drift_begin_switch(void);
+void locations_drift_end_switch(void);
+
+/* The number of drifted accounts, in constant time. */
+guint locations_drift_get_count(void);
+
+/* The drifted accounts. Free the list with g_list_free(). */
+GList *locations_drift_get_accounts(void);
+
+/*
+ * Record the live state of the drifted accounts in the active set. Each one
+ * goes into the topmost layer recording it that makes the set evaluate to
+ * the live state, which is not always the topmost one: a union layer cannot
+ * disable an account the layers below enable. Without such a layer, every
+ * layer recording the account takes the live state. The caller saves the
+ * model.
+ */
+void locations_drift_save(void);
+
+/* Switch back only the drifted accounts to the state of the active set. */
+void locations_drift_reapply(void);
+
+#endif /* _LOCATIONS_DRIFT_H_ */
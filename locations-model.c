@@ -0,0 +1,693 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <account.h>
+#include <core.h>
+#include <debug.h>
+#include <prefs.h>
+#include <signals.h>
+#include <value.h>
+
+#include "locations-model.h"
+
+static GHashTable *locations_model = NULL;
+static GHashTable *locations_status = NULL;	/* Location name -> time_t */
+static guint locations_model_serial = 0;
+static gint batch_depth = 0;
+static GHashTable *batch_changed = NULL;	/* Locations changed in the running batch */
+static int handle;
+
+AccountStateInfo *
+account_state_info_new(PurpleAccount *account, gboolean enabled)
+{
+	AccountStateInfo *asi = NULL;
+
+	asi = g_new0(AccountStateInfo, 1);
+	asi->account = account;
+	asi->enabled = enabled;
+
+	return asi;
+}
+
+void
+account_state_info_free(AccountStateInfo *asi)
+{
+	if (asi == NULL) return;
+	g_free(asi);
+}
+
+/* Locations model functions */
+
+/* Notify a change of a location, or hold it back until the batch ends. */
+static void
+locations_model_changed(const gchar *location_name)
+{
+	locations_model_touch();
+
+	if (batch_depth > 0)
+		g_hash_table_replace(batch_changed, g_strdup(location_name), NULL);
+	else
+		purple_signal_emit(&handle, "location-changed", location_name);
+}
+
+void
+locations_model_begin_batch()
+{
+	batch_depth++;
+}
+
+void
+locations_model_end_batch()
+{
+	GList *names = NULL;
+
+	g_return_if_fail(batch_depth > 0);
+
+	if (--batch_depth > 0 || g_hash_table_size(batch_changed) == 0)
+		return;
+
+	names = g_hash_table_get_keys(batch_changed);
+	purple_signal_emit(&handle, "locations-changed", names);
+	g_list_free(names);
+	g_hash_table_remove_all(batch_changed);
+}
+
+/* A removed account no longer belongs to any location. */
+static void
+account_removed_cb(PurpleAccount *account, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer key = NULL,
+			 value = NULL;
+	GList *asis = NULL,
+		  *item = NULL;
+
+	if (locations_model == NULL)
+		return;
+
+	locations_model_begin_batch();
+	g_hash_table_iter_init(&iter, locations_model);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		asis = (GList *)value;
+		for (item = g_list_first(asis); item != NULL; item = g_list_next(item))
+		{
+			if (((AccountStateInfo *)item->data)->account == account)
+				break;
+		}
+		if (item == NULL)
+			continue;
+
+		account_state_info_free((AccountStateInfo *)item->data);
+		g_hash_table_iter_replace(&iter, g_list_delete_link(asis, item));
+		locations_model_changed((const gchar *)key);
+	}
+	locations_model_end_batch();
+}
+
+void
+locations_model_init()
+{
+	purple_prefs_add_none(PREF_PREFIX);
+	purple_prefs_add_none(PREF_LOCATIONS);
+	purple_prefs_add_string_list(PREF_LOCATION_ACCOUNT_MAP, NULL);
+	purple_prefs_add_string(PREF_LAST_LOCATION, "");
+	purple_prefs_add_string_list(PREF_LOCATION_STATUS_MAP, NULL);
+
+	purple_signal_register(&handle, "location-added",
+			purple_marshal_VOID__POINTER, NULL, 1,
+			purple_value_new(PURPLE_TYPE_STRING));
+	purple_signal_register(&handle, "location-changed",
+			purple_marshal_VOID__POINTER, NULL, 1,
+			purple_value_new(PURPLE_TYPE_STRING));
+	purple_signal_register(&handle, "location-removed",
+			purple_marshal_VOID__POINTER, NULL, 1,
+			purple_value_new(PURPLE_TYPE_STRING));
+	purple_signal_register(&handle, "locations-reloaded",
+			purple_marshal_VOID, NULL, 0);
+	purple_signal_register(&handle, "locations-changed",
+			purple_marshal_VOID__POINTER, NULL, 1,
+			purple_value_new(PURPLE_TYPE_POINTER));
+
+	batch_changed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	purple_signal_connect(purple_accounts_get_handle(), "account-removed",
+			&handle, PURPLE_CALLBACK(account_removed_cb), NULL);
+}
+
+void
+locations_model_uninit()
+{
+	purple_signals_disconnect_by_handle(&handle);
+	purple_signals_unregister_by_instance(&handle);
+
+	g_hash_table_destroy(batch_changed);
+	batch_changed = NULL;
+	batch_depth = 0;
+}
+
+void *
+locations_model_get_handle()
+{
+	return &handle;
+}
+
+/*
+ * Split a "location:username:protocol:state" entry in place. Neither the
+ * location name, the protocol id nor the state contain ':', so the
+ * username is whatever lies between the first and the last but one ':'.
+ */
+static gboolean
+locations_model_parse_entry(gchar *entry, gchar **name, gchar **username,
+		gchar **protocol_id, gchar **state)
+{
+	gchar *sep = NULL;
+
+	*name = entry;
+	if ((sep = strchr(entry, ':')) == NULL)
+		return FALSE;
+	*sep = '\0';
+	*username = sep + 1;
+
+	if ((sep = strrchr(*username, ':')) == NULL)
+		return FALSE;
+	*sep = '\0';
+	*state = sep + 1;
+
+	if ((sep = strrchr(*username, ':')) == NULL)
+		return FALSE;
+	*sep = '\0';
+	*protocol_id = sep + 1;
+
+	return TRUE;
+}
+
+/*
+ * Index the accounts by username, so loading does not scan the whole
+ * account list for every entry as purple_accounts_find() does.
+ */
+static GHashTable *
+locations_model_index_accounts(void)
+{
+	GHashTable *index = NULL;
+	GList *item = NULL;
+	PurpleAccount *account = NULL;
+
+	index = g_hash_table_new(g_str_hash, g_str_equal);
+	for (item = g_list_first(purple_accounts_get_all()); item != NULL; item = g_list_next(item))
+	{
+		account = (PurpleAccount *)item->data;
+		g_hash_table_insert(index, (gpointer)purple_account_get_username(account), account);
+	}
+
+	return index;
+}
+
+static PurpleAccount *
+locations_model_find_account(GHashTable *index, const gchar *username, const gchar *protocol_id)
+{
+	PurpleAccount *account = NULL;
+
+	account = (PurpleAccount *)g_hash_table_lookup(index, username);
+	if (account != NULL && g_strcmp0(purple_account_get_protocol_id(account), protocol_id) == 0)
+		return account;
+
+	/* The username is not normalized, or is shared by several protocols. */
+	return purple_accounts_find(username, protocol_id);
+}
+
+/* Read the saved statuses of the locations loaded from the account map. */
+static void
+locations_model_load_status(void)
+{
+	GList *map = NULL,
+		  *item = NULL;
+	gchar *sep = NULL;
+	time_t *creation_time = NULL;
+
+	map = purple_prefs_get_string_list(PREF_LOCATION_STATUS_MAP);
+	for (item = g_list_first(map); item != NULL; item = g_list_next(item))
+	{
+		sep = strrchr((gchar *)item->data, ':');
+		if (sep != NULL)
+			*sep = '\0';
+
+		if (sep != NULL && locations_model_location_exists((gchar *)item->data))
+		{
+			creation_time = g_new(time_t, 1);
+			*creation_time = (time_t)g_ascii_strtoll(sep + 1, NULL, 10);
+			g_hash_table_insert(locations_status, g_strdup((gchar *)item->data), creation_time);
+		}
+		else
+			purple_debug_info("locations", "Ignore status of unknown location %s\n",
+					(gchar *)item->data);
+
+		g_free(item->data);
+	}
+
+	g_list_free(map);
+}
+
+void
+locations_model_load()
+{
+	GList *map = NULL,
+		  *item = NULL;
+	GList *account_list = NULL;
+	GHashTable *index = NULL;
+	GHashTableIter iter;
+	gpointer key = NULL,
+			 value = NULL;
+	gchar *name = NULL,
+		  *username = NULL,
+		  *protocol_id = NULL,
+		  *state = NULL;
+	PurpleAccount *account = NULL;
+
+	locations_model = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, /* free the Key */
+			NULL
+			);
+	locations_status = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	locations_model_touch();
+
+	map = purple_prefs_get_string_list(PREF_LOCATION_ACCOUNT_MAP);
+	if (map == NULL)
+	{
+		purple_signal_emit(&handle, "locations-reloaded");
+		return;
+	}
+
+	index = locations_model_index_accounts();
+
+	for (item = g_list_first(map); item != NULL; item = g_list_next(item))
+	{
+		if (!locations_model_parse_entry((gchar *)item->data,
+					&name, &username, &protocol_id, &state))
+		{
+			purple_debug_warning("locations", "Ignore malformed entry %s\n",
+					(gchar *)item->data);
+		}
+		else if ((account = locations_model_find_account(index, username, protocol_id)) == NULL)
+		{
+			/* The account was removed after the location was saved. */
+			purple_debug_info("locations", "Ignore unknown account %s (%s)\n",
+					username, protocol_id);
+		}
+		else if (g_hash_table_lookup_extended(locations_model, name, &key, &value))
+		{
+			/*
+			 * Prepend here and reverse below, appending is quadratic. The key
+			 * is stolen first, inserting it again would free it.
+			 */
+			g_hash_table_steal(locations_model, key);
+			g_hash_table_insert(locations_model, key,
+					g_list_prepend((GList *)value,
+						account_state_info_new(account, g_strcmp0(state, "enabled") == 0)));
+		}
+		else
+		{
+			account_list = g_list_prepend(NULL,
+					account_state_info_new(account, g_strcmp0(state, "enabled") == 0));
+			g_hash_table_insert(locations_model, g_strdup(name), account_list);
+		}
+
+		g_free((gchar *)item->data);
+	}
+
+	g_hash_table_iter_init(&iter, locations_model);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_hash_table_iter_replace(&iter, g_list_reverse((GList *)value));
+
+	g_hash_table_destroy(index);
+	g_list_free(map);
+
+	locations_model_load_status();
+
+	purple_signal_emit(&handle, "locations-reloaded");
+}
+
+static void
+locations_model_save_status(void)
+{
+	GList *mapping = NULL;
+	GHashTableIter iter;
+	gpointer key = NULL,
+			 value = NULL;
+
+	g_hash_table_iter_init(&iter, locations_status);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		mapping = g_list_prepend(mapping, g_strdup_printf("%s:%" G_GINT64_FORMAT,
+					(gchar *)key, (gint64)*(time_t *)value));
+
+	purple_prefs_set_string_list(PREF_LOCATION_STATUS_MAP, mapping);
+
+	g_list_foreach(mapping, (GFunc)g_free, NULL);
+	g_list_free(mapping);
+}
+
+void
+locations_model_save()
+{
+	GList *keys = NULL,
+		  *key_item = NULL,
+		  *values = NULL,
+		  *value_item = NULL,
+		  *mapping = NULL,
+		  *item = NULL;
+	GString *buffer = NULL;
+	AccountStateInfo *asi = NULL;
+
+	if (locations_model == NULL)
+		return;
+
+	/*
+	 * All entries are written one after another into a single buffer, and
+	 * the mapping first records their offsets since the buffer may move
+	 * while it grows.
+	 */
+	buffer = g_string_sized_new(1024);
+
+	keys = locations_model_get_locations_names();
+	key_item = g_list_first(keys);
+	for (; key_item != NULL; key_item = g_list_next(key_item))
+	{
+		values = locations_model_lookup_accounts((gchar *)key_item->data);
+		value_item = g_list_first(values);
+		for (; value_item != NULL; value_item = g_list_next(value_item))
+		{
+			asi = (AccountStateInfo *)value_item->data;
+			mapping = g_list_prepend(mapping, GSIZE_TO_POINTER(buffer->len));
+
+			g_string_append(buffer, (gchar *)key_item->data);
+			g_string_append_c(buffer, ':');
+			g_string_append(buffer, purple_account_get_username(asi->account));
+			g_string_append_c(buffer, ':');
+			g_string_append(buffer, purple_account_get_protocol_id(asi->account));
+			g_string_append_c(buffer, ':');
+			g_string_append(buffer, asi->enabled ? "enabled" : "disabled");
+			g_string_append_c(buffer, '\0');
+		}
+	}
+	g_list_free(keys);
+
+	mapping = g_list_reverse(mapping);
+	for (item = mapping; item != NULL; item = g_list_next(item))
+		item->data = buffer->str + GPOINTER_TO_SIZE(item->data);
+
+	purple_prefs_set_string_list(PREF_LOCATION_ACCOUNT_MAP, mapping);
+
+	g_list_free(mapping);
+	g_string_free(buffer, TRUE);
+
+	locations_model_save_status();
+}
+
+gboolean
+locations_model_location_exists(const gchar *name)
+{
+	return g_hash_table_lookup_extended(locations_model, name, NULL, NULL);
+}
+
+void
+locations_model_add_location(const gchar *name, GList *asis)
+{
+	gboolean existed = FALSE;
+
+	existed = locations_model_location_exists(name);
+	g_hash_table_insert(locations_model, g_strdup(name), asis);
+
+	if (existed)
+		locations_model_changed(name);
+	else
+	{
+		locations_model_touch();
+		purple_signal_emit(&handle, "location-added", name);
+	}
+}
+
+void
+locations_model_add_location_from_current(const gchar *name)
+{
+	GList *asis = NULL,
+		  *account_item = NULL;
+	PurpleAccount *account = NULL;
+
+	account_item = g_list_first(purple_accounts_get_all());
+	for (; account_item != NULL; account_item = g_list_next(account_item))
+	{
+		account = (PurpleAccount *)account_item->data;
+		asis = g_list_append(asis,
+				account_state_info_new(account,
+					purple_account_get_enabled(account, purple_core_get_ui())));
+	}
+
+	locations_model_add_location(name, asis);
+}
+
+void
+locations_model_set_account_state(const gchar *location_name,
+		PurpleAccount *account, gboolean enabled)
+{
+	GList *asis = NULL,
+		  *item = NULL;
+	AccountStateInfo *asi = NULL;
+
+	asis = locations_model_lookup_accounts(location_name);
+	for (item = g_list_first(asis); item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		if (asi->account == account)
+		{
+			asi->enabled = enabled;
+			locations_model_changed(location_name);
+			return;
+		}
+	}
+
+	/* Put the AccountStateInfo list back to the locations model with the new account. */
+	locations_model_add_location(location_name,
+			g_list_append(asis, account_state_info_new(account, enabled)));
+}
+
+void
+locations_model_set_all_accounts(const gchar *location_name, gboolean enabled)
+{
+	GList *item = NULL;
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+		((AccountStateInfo *)item->data)->enabled = enabled;
+
+	locations_model_changed(location_name);
+}
+
+void
+locations_model_set_protocol_accounts(const gchar *location_name,
+		const gchar *protocol_id, gboolean enabled)
+{
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		if (g_strcmp0(purple_account_get_protocol_id(asi->account), protocol_id) == 0)
+			asi->enabled = enabled;
+	}
+
+	locations_model_changed(location_name);
+}
+
+void
+locations_model_update_accounts(const gchar *location_name, GList *states)
+{
+	GHashTable *index = NULL;
+	GList *asis = NULL,
+		  *added = NULL,
+		  *item = NULL;
+	AccountStateInfo *asi = NULL,
+					 *state = NULL;
+
+	/* Creating a location here would bypass location-added. */
+	g_return_if_fail(locations_model_location_exists(location_name));
+
+	/* Index the location once rather than searching it for every state. */
+	index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	asis = locations_model_lookup_accounts(location_name);
+	for (item = g_list_first(asis); item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		g_hash_table_insert(index, asi->account, asi);
+	}
+
+	for (item = g_list_first(states); item != NULL; item = g_list_next(item))
+	{
+		state = (AccountStateInfo *)item->data;
+		asi = (AccountStateInfo *)g_hash_table_lookup(index, state->account);
+		if (asi == NULL)
+		{
+			asi = account_state_info_new(state->account, state->enabled);
+			g_hash_table_insert(index, asi->account, asi);
+			added = g_list_prepend(added, asi);
+		}
+		else
+		{
+			asi->enabled = state->enabled;
+		}
+	}
+
+	/* Insert directly, locations_model_add_location() would notify twice. */
+	if (added != NULL)
+		g_hash_table_insert(locations_model, g_strdup(location_name),
+				g_list_concat(asis, g_list_reverse(added)));
+
+	g_hash_table_destroy(index);
+	locations_model_changed(location_name);
+}
+
+void
+locations_model_copy_states(const gchar *dst_location, const gchar *src_location)
+{
+	if (g_strcmp0(dst_location, src_location) == 0)
+		return;
+
+	locations_model_update_accounts(dst_location,
+			locations_model_lookup_accounts(src_location));
+}
+
+static void
+locations_model_free_account_info_cb(gpointer data, gpointer user_data)
+{
+	account_state_info_free((AccountStateInfo *)data);
+}
+
+static gboolean
+locations_model_foreach_free_cb(gpointer key, gpointer value, gpointer data)
+{
+	g_list_foreach((GList *)value, locations_model_free_account_info_cb, NULL);
+	g_list_free((GList *)value);
+
+	return TRUE;
+}
+
+void
+locations_model_free()
+{
+	if (locations_model == NULL)
+		return;
+
+	g_hash_table_foreach_remove(locations_model, locations_model_foreach_free_cb, NULL);
+	g_hash_table_destroy(locations_model);
+	locations_model = NULL;
+	g_hash_table_destroy(locations_status);
+	locations_status = NULL;
+	locations_model_touch();
+}
+
+GList *
+locations_model_get_locations_names()
+{
+	return g_hash_table_get_keys(locations_model);
+}
+
+GList *
+locations_model_lookup_accounts(const gchar *location_name)
+{
+	return (GList *)g_hash_table_lookup(locations_model, location_name);
+}
+
+gboolean
+locations_model_delete_location(const gchar *location_name)
+{
+	GList *asis = NULL;
+	gchar *name = NULL;
+
+	if (!locations_model_location_exists(location_name))
+		return FALSE;
+
+	asis = locations_model_lookup_accounts(location_name);
+	g_list_foreach(asis, locations_model_free_account_info_cb, NULL);
+	g_list_free(asis);
+
+	/* location_name may be the key about to be freed. */
+	name = g_strdup(location_name);
+	g_hash_table_remove(locations_model, name);
+	g_hash_table_remove(locations_status, name);
+	g_hash_table_remove(batch_changed, name);
+	locations_model_touch();
+	purple_signal_emit(&handle, "location-removed", name);
+	g_free(name);
+
+	return TRUE;
+}
+
+time_t
+locations_model_get_status(const gchar *location_name)
+{
+	time_t *creation_time = NULL;
+
+	creation_time = (time_t *)g_hash_table_lookup(locations_status, location_name);
+	return creation_time != NULL ? *creation_time : 0;
+}
+
+void
+locations_model_set_status(const gchar *location_name, time_t creation_time)
+{
+	time_t *value = NULL;
+
+	if (!locations_model_location_exists(location_name))
+		return;
+
+	if (creation_time == 0)
+		g_hash_table_remove(locations_status, location_name);
+	else
+	{
+		value = g_new(time_t, 1);
+		*value = creation_time;
+		g_hash_table_replace(locations_status, g_strdup(location_name), value);
+	}
+
+	locations_model_changed(location_name);
+}
+
+guint
+locations_model_get_serial()
+{
+	return locations_model_serial;
+}
+
+void
+locations_model_touch()
+{
+	locations_model_serial++;
+}
+/*** End of locations model functions ***/
@@ -0,0 +1,145 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Locations model: the set of named locations, each one mapping accounts
+ * to their enabled state, and its persistence in the purple prefs.
+ *
+ * The model is the base of the core library (liblocations-core.a), which
+ * has no GTK dependency and is shared by the plugin, the tests and the
+ * benchmark.
+ */
+
+#ifndef _LOCATIONS_MODEL_H_
+#define _LOCATIONS_MODEL_H_
+
+#include <glib.h>
+
+#include <account.h>
+
+/* The prefs keep their historical paths so existing profiles still load. */
+#define PREF_PREFIX "/plugins/gtk"
+#define PREF_LOCATIONS PREF_PREFIX "/locations"
+#define PREF_LOCATION_ACCOUNT_MAP PREF_LOCATIONS "/map"
+#define PREF_LAST_LOCATION PREF_LOCATIONS "/last"
+#define PREF_LOCATION_STATUS_MAP PREF_LOCATIONS "/status"
+
+typedef struct
+{
+	PurpleAccount *account;
+	gboolean enabled;
+} AccountStateInfo;
+
+AccountStateInfo *account_state_info_new(PurpleAccount *account, gboolean enabled);
+void account_state_info_free(AccountStateInfo *asi);
+
+/*
+ * Register the prefs and the signals of the model. The signals, emitted on
+ * locations_model_get_handle(), are:
+ *
+ *   location-added (const gchar *location_name)
+ *   location-changed (const gchar *location_name)
+ *   location-removed (const gchar *location_name)
+ *   locations-reloaded (void), after locations_model_load()
+ *   locations-changed (GList *location_names), once at the end of a batch
+ *     instead of location-changed for each location it changed
+ *
+ * An account removed from libpurple is dropped from every location, as one
+ * batch.
+ */
+void locations_model_init(void);
+void locations_model_uninit(void);
+void *locations_model_get_handle(void);
+
+void locations_model_load(void);
+void locations_model_save(void);
+void locations_model_free(void);
+
+/*
+ * Returns the names of all locations. The list must be freed with
+ * g_list_free(), the names are owned by the model.
+ */
+GList *locations_model_get_locations_names(void);
+
+/* Returns the AccountStateInfo list of a location, owned by the model. */
+GList *locations_model_lookup_accounts(const gchar *location_name);
+
+gboolean locations_model_location_exists(const gchar *name);
+
+/* The model takes ownership of asis. */
+void locations_model_add_location(const gchar *name, GList *asis);
+
+/* Add a location that records the current enabled state of every account. */
+void locations_model_add_location_from_current(const gchar *name);
+
+/*
+ * Set the state of one account in a location, appending it if the
+ * location does not know the account yet.
+ */
+void locations_model_set_account_state(const gchar *location_name,
+		PurpleAccount *account, gboolean enabled);
+
+gboolean locations_model_delete_location(const gchar *location_name);
+
+/*
+ * The saved status a location switches to, as the creation time of the
+ * PurpleSavedStatus, or 0 if the location keeps the current status. The
+ * statuses are kept in PREF_LOCATION_STATUS_MAP as "location:time" strings.
+ */
+time_t locations_model_get_status(const gchar *location_name);
+void locations_model_set_status(const gchar *location_name, time_t creation_time);
+
+/*
+ * Batched mutations. Each one changes any number of accounts of a location
+ * but touches the model once, so the caller refreshes its views and saves
+ * once afterwards.
+ */
+void locations_model_set_all_accounts(const gchar *location_name, gboolean enabled);
+void locations_model_set_protocol_accounts(const gchar *location_name,
+		const gchar *protocol_id, gboolean enabled);
+
+/*
+ * Take the state of every account in states, a list of AccountStateInfo
+ * not owned by the model. Accounts the location does not know yet are
+ * appended to it. The location must exist.
+ */
+void locations_model_update_accounts(const gchar *location_name, GList *states);
+
+/* Copy the states recorded by one location into another. */
+void locations_model_copy_states(const gchar *dst_location, const gchar *src_location);
+
+/*
+ * Group the changes of several locations into one notification. Batches
+ * nest, the changes are reported when the outermost one ends.
+ */
+void locations_model_begin_batch(void);
+void locations_model_end_batch(void);
+
+/*
+ * A number that changes whenever the model changes, so derived data such
+ * as the compiled location sets can tell when it is stale. Code that
+ * changes an AccountStateInfo directly must call locations_model_touch().
+ */
+guint locations_model_get_serial(void);
+void locations_model_touch(void);
+
+#endif /* _LOCATIONS_MODEL_H_ */
@@ -0,0 +1,311 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <debug.h>
+#include <prefs.h>
+#include <signals.h>
+
+#include "locations-model.h"
+#include "locations-predict.h"
+
+#define HOURS_PER_DAY 24
+
+/*
+ * Counts are halved when one reaches this limit, so the history follows
+ * changing habits and the persisted numbers stay small.
+ */
+#define HISTORY_COUNT_MAX 256
+
+typedef struct
+{
+	GHashTable *next;	/* Location name -> GUINT count of switches to it */
+	guint next_total;
+	guint hours[HOURS_PER_DAY];
+} LocationHistory;
+
+static int handle;
+
+static GHashTable *history = NULL;	/* Location name -> LocationHistory */
+
+static void
+location_history_free(gpointer data)
+{
+	LocationHistory *lh = (LocationHistory *)data;
+
+	g_hash_table_destroy(lh->next);
+	g_free(lh);
+}
+
+static LocationHistory *
+location_history_get(const gchar *location_name)
+{
+	LocationHistory *lh = NULL;
+
+	lh = (LocationHistory *)g_hash_table_lookup(history, location_name);
+	if (lh == NULL)
+	{
+		lh = g_new0(LocationHistory, 1);
+		lh->next = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		g_hash_table_insert(history, g_strdup(location_name), lh);
+	}
+
+	return lh;
+}
+
+static void
+location_history_add_next(LocationHistory *lh, const gchar *to, guint count)
+{
+	GHashTableIter iter;
+	gpointer value = NULL;
+	guint current = 0;
+
+	current = GPOINTER_TO_UINT(g_hash_table_lookup(lh->next, to)) + count;
+	g_hash_table_replace(lh->next, g_strdup(to), GUINT_TO_POINTER(current));
+	lh->next_total += count;
+
+	if (current < HISTORY_COUNT_MAX)
+		return;
+
+	lh->next_total = 0;
+	g_hash_table_iter_init(&iter, lh->next);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		current = GPOINTER_TO_UINT(value) / 2;
+		if (current == 0)
+			g_hash_table_iter_remove(&iter);
+		else
+			g_hash_table_iter_replace(&iter, GUINT_TO_POINTER(current));
+		lh->next_total += current;
+	}
+}
+
+static void
+location_history_add_hour(LocationHistory *lh, gint hour, guint count)
+{
+	gint i = 0;
+
+	lh->hours[hour] += count;
+	if (lh->hours[hour] < HISTORY_COUNT_MAX)
+		return;
+
+	for (i = 0; i < HOURS_PER_DAY; ++i)
+		lh->hours[i] /= 2;
+}
+
+/* Forget a deleted location, both as a source and as a target. */
+static void
+location_removed_cb(const gchar *location_name, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value = NULL;
+	LocationHistory *lh = NULL;
+
+	g_hash_table_remove(history, location_name);
+
+	g_hash_table_iter_init(&iter, history);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		lh = (LocationHistory *)value;
+		lh->next_total -= GPOINTER_TO_UINT(g_hash_table_lookup(lh->next, location_name));
+		g_hash_table_remove(lh->next, location_name);
+	}
+
+	locations_predict_save();
+}
+
+void
+locations_predict_init()
+{
+	purple_prefs_add_string_list(PREF_HISTORY, NULL);
+
+	history = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, location_history_free);
+
+	purple_signal_connect(locations_model_get_handle(), "location-removed",
+			&handle, PURPLE_CALLBACK(location_removed_cb), NULL);
+}
+
+void
+locations_predict_uninit()
+{
+	purple_signals_disconnect_by_handle(&handle);
+
+	g_hash_table_destroy(history);
+	history = NULL;
+}
+
+void
+locations_predict_load()
+{
+	GList *entries = NULL,
+		  *item = NULL;
+	gchar **fields = NULL;
+	guint64 number = 0,
+			count = 0;
+
+	g_hash_table_remove_all(history);
+
+	entries = purple_prefs_get_string_list(PREF_HISTORY);
+	for (item = g_list_first(entries); item != NULL; item = g_list_next(item))
+	{
+		fields = g_strsplit((gchar *)item->data, ":", 4);
+		if (g_strv_length(fields) == 4)
+			count = g_ascii_strtoull(fields[3], NULL, 10);
+
+		if (count == 0 || count >= HISTORY_COUNT_MAX)
+			purple_debug_warning("locations", "Ignore malformed history entry %s\n",
+					(gchar *)item->data);
+		else if (strcmp(fields[0], "t") == 0)
+			location_history_add_next(location_history_get(fields[1]), fields[2], count);
+		else if (strcmp(fields[0], "h") == 0 &&
+				(number = g_ascii_strtoull(fields[2], NULL, 10)) < HOURS_PER_DAY)
+			location_history_add_hour(location_history_get(fields[1]), number, count);
+		else
+			purple_debug_warning("locations", "Ignore malformed history entry %s\n",
+					(gchar *)item->data);
+
+		count = 0;
+		g_strfreev(fields);
+		g_free(item->data);
+	}
+
+	g_list_free(entries);
+}
+
+void
+locations_predict_save()
+{
+	GList *entries = NULL;
+	GHashTableIter iter,
+				   next_iter;
+	gpointer key = NULL,
+			 value = NULL,
+			 to = NULL,
+			 count = NULL;
+	LocationHistory *lh = NULL;
+	gint i = 0;
+
+	g_hash_table_iter_init(&iter, history);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		lh = (LocationHistory *)value;
+
+		g_hash_table_iter_init(&next_iter, lh->next);
+		while (g_hash_table_iter_next(&next_iter, &to, &count))
+			entries = g_list_prepend(entries, g_strdup_printf("t:%s:%s:%u",
+						(gchar *)key, (gchar *)to, GPOINTER_TO_UINT(count)));
+
+		for (i = 0; i < HOURS_PER_DAY; ++i)
+		{
+			if (lh->hours[i] > 0)
+				entries = g_list_prepend(entries, g_strdup_printf("h:%s:%d:%u",
+							(gchar *)key, i, lh->hours[i]));
+		}
+	}
+
+	purple_prefs_set_string_list(PREF_HISTORY, entries);
+
+	g_list_foreach(entries, (GFunc)g_free, NULL);
+	g_list_free(entries);
+}
+
+gint
+locations_predict_current_hour()
+{
+	GDateTime *now = NULL;
+	gint hour = 0;
+
+	now = g_date_time_new_now_local();
+	hour = g_date_time_get_hour(now);
+	g_date_time_unref(now);
+
+	return hour;
+}
+
+void
+locations_predict_record(const gchar *from, const gchar *to, gint hour)
+{
+	g_return_if_fail(to != NULL && hour >= 0 && hour < HOURS_PER_DAY);
+
+	if (from != NULL && *from != '\0' && strcmp(from, to) != 0)
+		location_history_add_next(location_history_get(from), to, 1);
+
+	location_history_add_hour(location_history_get(to), hour, 1);
+
+	locations_predict_save();
+}
+
+const gchar *
+locations_predict_next(const gchar *current, gint hour)
+{
+	GHashTableIter iter;
+	gpointer key = NULL,
+			 value = NULL;
+	LocationHistory *from = NULL,
+					*lh = NULL;
+	guint hour_total = 0;
+	gdouble score = 0,
+			best_score = 0;
+	const gchar *best = NULL;
+
+	g_return_val_if_fail(hour >= 0 && hour < HOURS_PER_DAY, NULL);
+
+	if (current != NULL)
+		from = (LocationHistory *)g_hash_table_lookup(history, current);
+
+	g_hash_table_iter_init(&iter, history);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		hour_total += ((LocationHistory *)value)->hours[hour];
+
+	/* Both terms are frequencies, a likely transition and a likely hour weigh the same. */
+	g_hash_table_iter_init(&iter, history);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		lh = (LocationHistory *)value;
+		if (g_strcmp0((gchar *)key, current) == 0 ||
+				!locations_model_location_exists((gchar *)key))
+			continue;
+
+		score = 0;
+		if (from != NULL && from->next_total > 0)
+			score += (gdouble)GPOINTER_TO_UINT(g_hash_table_lookup(from->next, key)) /
+				from->next_total;
+		if (hour_total > 0)
+			score += (gdouble)lh->hours[hour] / hour_total;
+
+		if (score > best_score ||
+				(score == best_score && best != NULL && strcmp((gchar *)key, best) < 0))
+		{
+			best_score = score;
+			best = (const gchar *)key;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,65 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Usage history of the locations, to predict the next switch. Every switch
+ * counts the transition from the previous location and the hour of day it
+ * happened at. The next location is the one that most often follows the
+ * current one and is most often switched to at this hour.
+ */
+
+#ifndef _LOCATIONS_PREDICT_H_
+#define _LOCATIONS_PREDICT_H_
+
+#include <glib.h>
+
+#include "locations-model.h"
+
+/*
+ * Kept as "t:from:to:count" and "h:location:hour:count" strings. Location
+ * names never contain ':', as in the account map of the model.
+ */
+#define PREF_HISTORY PREF_LOCATIONS "/history"
+
+void locations_predict_init(void);
+void locations_predict_uninit(void);
+
+void locations_predict_load(void);
+void locations_predict_save(void);
+
+/* The local hour of day, 0 to 23. */
+gint locations_predict_current_hour(void);
+
+/*
+ * Count a switch from one location to another at the given hour. The
+ * previous location may be NULL or empty on the first switch.
+ */
+void locations_predict_record(const gchar *from, const gchar *to, gint hour);
+
+/*
+ * The location most likely switched to next from the current one at the
+ * given hour, or NULL without enough history. The name is owned by the
+ * history and valid until it changes.
+ */
+const gchar *locations_predict_next(const gchar *current, gint hour);
+
+#endif /* _LOCATIONS_PREDICT_H_ */
@@ -0,0 +1,535 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <account.h>
+#include <connection.h>
+#include <core.h>
+#include <debug.h>
+#include <dnsquery.h>
+#include <eventloop.h>
+#include <prefs.h>
+#include <proxy.h>
+#include <signals.h>
+
+#include "locations-model.h"
+#include "locations-predict.h"
+#include "locations-prewarm.h"
+#include "locations-switch.h"
+
+/* Predictions are refreshed twice per lifetime of a cache entry. */
+#define PREWARM_TTL 600
+#define PREWARM_INTERVAL (PREWARM_TTL / 2)
+
+typedef struct
+{
+	gchar *host;
+	gchar *srv_domain;	/* The domain whose SRV record named the host, or NULL */
+	GList *addresses;	/* GInetAddress, NULL while resolving */
+	gint64 resolved_at;
+	GCancellable *cancellable;	/* Set while resolving */
+	GList link;	/* In the LRU queue, data points to the entry */
+} PrewarmEntry;
+
+static int handle;
+
+static GResolver *resolver = NULL;
+static GHashTable *cache = NULL;	/* Lowercase hostname -> PrewarmEntry */
+static GQueue lru = G_QUEUE_INIT;	/* Most recently used first */
+static GCancellable *srv_cancellable = NULL;
+static guint pending = 0;
+static guint interval_timer = 0;
+static guint switch_idle = 0;
+static gboolean dns_ui_installed = FALSE;
+
+static void
+prewarm_entry_free(gpointer data)
+{
+	PrewarmEntry *entry = (PrewarmEntry *)data;
+
+	if (entry->cancellable != NULL)
+	{
+		g_cancellable_cancel(entry->cancellable);
+		g_object_unref(entry->cancellable);
+	}
+
+	g_queue_unlink(&lru, &entry->link);
+	g_resolver_free_addresses(entry->addresses);
+	g_free(entry->host);
+	g_free(entry->srv_domain);
+	g_free(entry);
+}
+
+static gboolean
+prewarm_entry_fresh(PrewarmEntry *entry)
+{
+	return entry->cancellable != NULL ||
+		g_get_monotonic_time() - entry->resolved_at < PREWARM_TTL * G_USEC_PER_SEC;
+}
+
+static PrewarmEntry *
+prewarm_lookup(const gchar *host)
+{
+	PrewarmEntry *entry = NULL;
+	gchar *key = NULL;
+
+	key = g_ascii_strdown(host, -1);
+	entry = (PrewarmEntry *)g_hash_table_lookup(cache, key);
+	g_free(key);
+
+	if (entry != NULL && !prewarm_entry_fresh(entry))
+	{
+		g_hash_table_remove(cache, entry->host);
+		entry = NULL;
+	}
+
+	if (entry != NULL)
+	{
+		g_queue_unlink(&lru, &entry->link);
+		g_queue_push_head_link(&lru, &entry->link);
+	}
+
+	return entry;
+}
+
+static void
+prewarm_evict(void)
+{
+	gint capacity = 0;
+	PrewarmEntry *entry = NULL;
+
+	capacity = MAX(purple_prefs_get_int(PREF_PREWARM_CACHE_SIZE), 1);
+	while (g_queue_get_length(&lru) > (guint)capacity)
+	{
+		entry = (PrewarmEntry *)g_queue_peek_tail(&lru);
+		g_hash_table_remove(cache, entry->host);
+	}
+}
+
+static void
+prewarm_resolved_cb(GObject *source, GAsyncResult *result, gpointer data)
+{
+	gchar *host = (gchar *)data;
+	GList *addresses = NULL;
+	GError *error = NULL;
+	PrewarmEntry *entry = NULL;
+
+	--pending;
+
+	addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(source), result, &error);
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+	{
+		/* Evicted or unloaded, the entry is gone */
+		g_error_free(error);
+		g_free(host);
+		return;
+	}
+
+	entry = (PrewarmEntry *)g_hash_table_lookup(cache, host);
+	if (entry == NULL)
+	{
+		g_clear_error(&error);
+		g_resolver_free_addresses(addresses);
+	}
+	else if (error != NULL)
+	{
+		purple_debug_info("locations", "Cannot pre-resolve %s: %s\n", host, error->message);
+		g_error_free(error);
+		g_hash_table_remove(cache, host);
+	}
+	else
+	{
+		g_object_unref(entry->cancellable);
+		entry->cancellable = NULL;
+		entry->addresses = addresses;
+		entry->resolved_at = g_get_monotonic_time();
+	}
+
+	g_free(host);
+}
+
+static void
+prewarm_host(const gchar *host, const gchar *srv_domain)
+{
+	PrewarmEntry *entry = NULL;
+
+	g_return_if_fail(cache != NULL);
+
+	if (host == NULL || *host == '\0')
+		return;
+
+	if ((entry = prewarm_lookup(host)) != NULL)
+	{
+		if (entry->srv_domain == NULL && srv_domain != NULL)
+			entry->srv_domain = g_ascii_strdown(srv_domain, -1);
+		return;
+	}
+
+	entry = g_new0(PrewarmEntry, 1);
+	entry->host = g_ascii_strdown(host, -1);
+	entry->srv_domain = srv_domain != NULL ? g_ascii_strdown(srv_domain, -1) : NULL;
+	entry->cancellable = g_cancellable_new();
+	entry->link.data = entry;
+	g_hash_table_insert(cache, entry->host, entry);
+	g_queue_push_head_link(&lru, &entry->link);
+
+	++pending;
+	g_resolver_lookup_by_name_async(resolver, entry->host, entry->cancellable,
+			prewarm_resolved_cb, g_strdup(entry->host));
+
+	prewarm_evict();
+}
+
+void
+locations_prewarm_host(const gchar *host)
+{
+	prewarm_host(host, NULL);
+}
+
+static void
+prewarm_srv_resolved_cb(GObject *source, GAsyncResult *result, gpointer data)
+{
+	gchar *domain = (gchar *)data;
+	GList *targets = NULL,
+		  *item = NULL;
+	GError *error = NULL;
+
+	--pending;
+
+	targets = g_resolver_lookup_service_finish(G_RESOLVER(source), result, &error);
+	if (error != NULL)
+	{
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			purple_debug_info("locations", "Cannot pre-resolve service: %s\n", error->message);
+		g_error_free(error);
+		g_free(domain);
+		return;
+	}
+
+	/* libpurple runs the SRV query itself and then asks for the targets */
+	for (item = targets; item != NULL; item = g_list_next(item))
+		prewarm_host(g_srv_target_get_hostname((GSrvTarget *)item->data), domain);
+
+	g_resolver_free_targets(targets);
+	g_free(domain);
+}
+
+static void
+prewarm_service(const gchar *service, const gchar *domain)
+{
+	++pending;
+	g_resolver_lookup_service_async(resolver, service, "tcp", domain,
+			srv_cancellable, prewarm_srv_resolved_cb, g_strdup(domain));
+}
+
+/*
+ * The server an account connects to. XMPP servers are found with an SRV
+ * query on the domain of the JID, which is also the fallback host, IRC
+ * servers are part of the username, and other protocols keep them in the
+ * "server" setting. Sets NULL for what does not apply, free both.
+ */
+static void
+prewarm_account_server(PurpleAccount *account, gchar **host, gchar **srv_domain)
+{
+	const gchar *protocol_id = NULL,
+				*server = NULL;
+	gchar *sep = NULL;
+
+	*host = NULL;
+	*srv_domain = NULL;
+	protocol_id = purple_account_get_protocol_id(account);
+
+	server = purple_account_get_string(account, "connect_server", NULL);
+	if (server == NULL || *server == '\0')
+		server = purple_account_get_string(account, "server", NULL);
+	if (server != NULL && *server != '\0')
+	{
+		*host = g_strdup(server);
+		return;
+	}
+
+	sep = strchr(purple_account_get_username(account), '@');
+	if (sep == NULL)
+		return;
+
+	if (strcmp(protocol_id, "prpl-jabber") == 0)
+	{
+		*host = g_strdup(sep + 1);
+		if ((sep = strchr(*host, '/')) != NULL)
+			*sep = '\0';
+		*srv_domain = g_strdup(*host);
+	}
+	else if (strcmp(protocol_id, "prpl-irc") == 0)
+		*host = g_strdup(sep + 1);
+}
+
+/*
+ * Resolve the server of an account. Accounts behind a proxy are left
+ * alone: the proxy resolves their servers, and a local lookup would leak
+ * the names, over Tor for one.
+ */
+static void
+prewarm_account(PurpleAccount *account)
+{
+	gchar *host = NULL,
+		  *srv_domain = NULL;
+	PurpleProxyInfo *proxy = NULL;
+
+	/* The account's own setup, the global one or the environment's */
+	proxy = purple_proxy_get_setup(account);
+	if (proxy != NULL && purple_proxy_info_get_type(proxy) != PURPLE_PROXY_NONE)
+		return;
+
+	prewarm_account_server(account, &host, &srv_domain);
+	if (srv_domain != NULL)
+		prewarm_service("xmpp-client", srv_domain);
+	locations_prewarm_host(host);
+
+	g_free(host);
+	g_free(srv_domain);
+}
+
+void
+locations_prewarm_location(const gchar *location_name)
+{
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+	const gchar *ui = NULL;
+
+	ui = purple_core_get_ui();
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		if (asi->enabled && !purple_account_get_enabled(asi->account, ui))
+			prewarm_account(asi->account);
+	}
+}
+
+void
+locations_prewarm_predicted()
+{
+	const gchar *next = NULL;
+
+	if (!purple_prefs_get_bool(PREF_PREWARM))
+		return;
+
+	next = locations_predict_next(locations_switch_get_last_location(),
+			locations_predict_current_hour());
+	if (next != NULL)
+	{
+		purple_debug_info("locations", "Pre-warming location %s\n", next);
+		locations_prewarm_location(next);
+	}
+}
+
+gboolean
+locations_prewarm_is_cached(const gchar *host)
+{
+	PrewarmEntry *entry = NULL;
+
+	entry = prewarm_lookup(host);
+	return entry != NULL && entry->addresses != NULL;
+}
+
+guint
+locations_prewarm_get_cache_size()
+{
+	return g_hash_table_size(cache);
+}
+
+guint
+locations_prewarm_get_pending()
+{
+	return pending;
+}
+
+/*
+ * Answer a DNS query from the cache, or leave it to libpurple's resolver.
+ * The hosts are pairs of address length and struct sockaddr, like
+ * libpurple's own resolver returns them.
+ */
+static gboolean
+prewarm_resolve_host(PurpleDnsQueryData *query_data,
+		PurpleDnsQueryResolvedCallback resolved_cb,
+		PurpleDnsQueryFailedCallback failed_cb)
+{
+	PrewarmEntry *entry = NULL;
+	GList *item = NULL;
+	GSList *hosts = NULL;
+	GSocketAddress *address = NULL;
+	gssize size = 0;
+	gpointer native = NULL;
+
+	entry = prewarm_lookup(purple_dnsquery_get_host(query_data));
+	if (entry == NULL || entry->addresses == NULL)
+		return FALSE;
+
+	for (item = entry->addresses; item != NULL; item = g_list_next(item))
+	{
+		address = g_inet_socket_address_new((GInetAddress *)item->data,
+				purple_dnsquery_get_port(query_data));
+		size = g_socket_address_get_native_size(address);
+		native = g_malloc0(size);
+
+		if (g_socket_address_to_native(address, native, size, NULL))
+		{
+			hosts = g_slist_append(hosts, GINT_TO_POINTER(size));
+			hosts = g_slist_append(hosts, native);
+		}
+		else
+			g_free(native);
+
+		g_object_unref(address);
+	}
+
+	if (hosts == NULL)
+		return FALSE;
+
+	resolved_cb(query_data, hosts);
+	return TRUE;
+}
+
+static PurpleDnsQueryUiOps prewarm_dns_ui_ops =
+{
+	prewarm_resolve_host,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+static gboolean
+prewarm_predicted_cb(gpointer data)
+{
+	switch_idle = 0;
+	locations_prewarm_predicted();
+
+	return FALSE;
+}
+
+static gboolean
+prewarm_interval_cb(gpointer data)
+{
+	locations_prewarm_predicted();
+
+	return TRUE;
+}
+
+/*
+ * The cached addresses may be why an account cannot reach its server, the
+ * next attempt resolves it again. The SRV targets of its domain go too.
+ */
+static void
+connection_error_cb(PurpleConnection *gc, PurpleConnectionError err,
+		const gchar *desc, gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value = NULL;
+	PrewarmEntry *entry = NULL;
+	gchar *host = NULL,
+		  *srv_domain = NULL;
+
+	if (err != PURPLE_CONNECTION_ERROR_NETWORK_ERROR)
+		return;
+
+	prewarm_account_server(purple_connection_get_account(gc), &host, &srv_domain);
+
+	g_hash_table_iter_init(&iter, cache);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		entry = (PrewarmEntry *)value;
+		if ((host != NULL && g_ascii_strcasecmp(entry->host, host) == 0) ||
+				(srv_domain != NULL && entry->srv_domain != NULL &&
+				 g_ascii_strcasecmp(entry->srv_domain, srv_domain) == 0))
+			g_hash_table_iter_remove(&iter);
+	}
+
+	g_free(host);
+	g_free(srv_domain);
+}
+
+/* A switch changes the prediction, pre-warm once it is done. */
+static void
+last_location_changed_cb(const char *name, PurplePrefType type, gconstpointer value, gpointer data)
+{
+	if (switch_idle == 0)
+		switch_idle = purple_timeout_add(0, prewarm_predicted_cb, NULL);
+}
+
+void
+locations_prewarm_init()
+{
+	purple_prefs_add_bool(PREF_PREWARM, TRUE);
+	purple_prefs_add_int(PREF_PREWARM_CACHE_SIZE, 32);
+
+	resolver = g_resolver_get_default();
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, prewarm_entry_free);
+	srv_cancellable = g_cancellable_new();
+
+	if (purple_dnsquery_get_ui_ops() == NULL)
+	{
+		purple_dnsquery_set_ui_ops(&prewarm_dns_ui_ops);
+		dns_ui_installed = TRUE;
+	}
+
+	purple_prefs_connect_callback(&handle, PREF_LAST_LOCATION, last_location_changed_cb, NULL);
+	purple_signal_connect(purple_connections_get_handle(), "connection-error",
+			&handle, PURPLE_CALLBACK(connection_error_cb), NULL);
+	interval_timer = purple_timeout_add_seconds(PREWARM_INTERVAL, prewarm_interval_cb, NULL);
+	switch_idle = purple_timeout_add(0, prewarm_predicted_cb, NULL);
+}
+
+void
+locations_prewarm_uninit()
+{
+	purple_prefs_disconnect_by_handle(&handle);
+	purple_signals_disconnect_by_handle(&handle);
+	purple_timeout_remove(interval_timer);
+	if (switch_idle != 0)
+		purple_timeout_remove(switch_idle);
+	interval_timer = 0;
+	switch_idle = 0;
+
+	if (dns_ui_installed && purple_dnsquery_get_ui_ops() == &prewarm_dns_ui_ops)
+		purple_dnsquery_set_ui_ops(NULL);
+	dns_ui_installed = FALSE;
+
+	/* Running lookups complete as cancelled and find nothing to update */
+	g_cancellable_cancel(srv_cancellable);
+	g_object_unref(srv_cancellable);
+	srv_cancellable = NULL;
+	g_hash_table_destroy(cache);
+	cache = NULL;
+	g_object_unref(resolver);
+	resolver = NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Pre-warming of the connections of the location likely switched to next.
+ * The server hostnames of the accounts it would enable are resolved ahead
+ * of time into a small LRU cache, which answers libpurple's DNS queries
+ * through the DNS query UI operations, so the switch does not wait for
+ * name resolution account after account. Accounts behind a proxy are not
+ * pre-warmed, and the servers of an account that fails to connect are
+ * dropped from the cache.
+ *
+ * Unlike the rest of the core library, this resolves through GIO's
+ * GResolver rather than libpurple alone.
+ */
+
+#ifndef _LOCATIONS_PREWARM_H_
+#define _LOCATIONS_PREWARM_H_
+
+#include <glib.h>
+
+#include "locations-model.h"
+
+#define PREF_PREWARM PREF_LOCATIONS "/prewarm"
+#define PREF_PREWARM_CACHE_SIZE PREF_LOCATIONS "/prewarm_cache_size"
+
+/*
+ * Start pre-warming for the predicted location after every switch and
+ * periodically, and answer DNS queries from the cache unless another DNS
+ * query UI is installed.
+ */
+void locations_prewarm_init(void);
+void locations_prewarm_uninit(void);
+
+/* Resolve a hostname into the cache, unless a fresh entry exists. */
+void locations_prewarm_host(const gchar *host);
+
+/* Resolve the servers of the accounts the location would newly enable. */
+void locations_prewarm_location(const gchar *location_name);
+
+/* Pre-warm the predicted next location, if enabled by PREF_PREWARM. */
+void locations_prewarm_predicted(void);
+
+/* Whether the cache holds fresh addresses for the hostname. */
+gboolean locations_prewarm_is_cached(const gchar *host);
+
+/* The number of cached hostnames, resolved or not, and running lookups. */
+guint locations_prewarm_get_cache_size(void);
+guint locations_prewarm_get_pending(void);
+
+#endif /* _LOCATIONS_PREWARM_H_ */
@@ -0,0 +1,467 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <account.h>
+#include <debug.h>
+#include <prefs.h>
+#include <signals.h>
+
+#include "locations-model.h"
+#include "locations-set.h"
+
+#define WORD_BITS 64
+
+typedef struct
+{
+	guint64 *recorded;	/* Accounts the location records */
+	guint64 *enabled;	/* Accounts the location enables, a subset of recorded */
+} LocationBits;
+
+static int handle;
+
+/* The active set, from bottom to top */
+static GList *set_layers = NULL;
+
+/* Dense account index: bit i of every bitmap is indexed_accounts[i]. */
+static GHashTable *account_index = NULL; /* PurpleAccount -> index + 1 */
+static GPtrArray *indexed_accounts = NULL;
+static guint n_words = 0;
+static gboolean account_index_stale = TRUE;
+
+/* Locations compiled into bitmaps, valid for one model serial */
+static GHashTable *compiled = NULL; /* location name -> LocationBits */
+static guint compiled_serial = 0;
+static gboolean compiled_valid = FALSE;
+
+/* Result of the last evaluation */
+static guint64 *effective_recorded = NULL;
+static guint64 *effective_enabled = NULL;
+static guint effective_words = 0;
+
+static const gchar *op_names[] = { "union", "intersect", "override" };
+
+/* The profile predates location sets, the first load takes the last location. */
+static gboolean migrate_last_location = FALSE;
+
+static inline guint
+bitmap_lowest_bit(guint64 word)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(word);
+#else
+	guint bit = 0;
+
+	while (!(word & 1))
+	{
+		word >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+static void
+location_bits_free(gpointer data)
+{
+	LocationBits *bits = (LocationBits *)data;
+
+	g_free(bits->recorded);
+	g_free(bits->enabled);
+	g_free(bits);
+}
+
+static void
+layer_free(LocationsSetLayer *layer)
+{
+	g_free(layer->location_name);
+	g_free(layer);
+}
+
+static void
+account_index_changed_cb(PurpleAccount *account, gpointer data)
+{
+	account_index_stale = TRUE;
+}
+
+/*
+ * A deleted location leaves the active set, which could not be evaluated
+ * with it. The layer left at the bottom becomes the base.
+ */
+static void
+location_removed_cb(const gchar *location_name, gpointer data)
+{
+	gboolean was_base = FALSE;
+
+	was_base = set_layers != NULL &&
+		g_strcmp0(((LocationsSetLayer *)set_layers->data)->location_name, location_name) == 0;
+	if (!locations_set_remove_layer(location_name))
+		return;
+
+	if (set_layers != NULL && (was_base || set_layers->next == NULL))
+		((LocationsSetLayer *)set_layers->data)->op = LOCATIONS_SET_OVERRIDE;
+
+	locations_set_save();
+}
+
+static void
+locations_set_index_accounts(void)
+{
+	GList *item = NULL;
+
+	if (!account_index_stale)
+		return;
+
+	g_hash_table_remove_all(account_index);
+	g_ptr_array_set_size(indexed_accounts, 0);
+
+	for (item = g_list_first(purple_accounts_get_all()); item != NULL; item = g_list_next(item))
+	{
+		g_ptr_array_add(indexed_accounts, item->data);
+		g_hash_table_insert(account_index, item->data,
+				GUINT_TO_POINTER(indexed_accounts->len));
+	}
+
+	n_words = (indexed_accounts->len + WORD_BITS - 1) / WORD_BITS;
+	account_index_stale = FALSE;
+
+	/* The bit positions moved, every compiled location is wrong now. */
+	compiled_valid = FALSE;
+}
+
+static void
+locations_set_refresh(void)
+{
+	locations_set_index_accounts();
+
+	if (compiled_valid && compiled_serial == locations_model_get_serial())
+		return;
+
+	g_hash_table_remove_all(compiled);
+	compiled_serial = locations_model_get_serial();
+	compiled_valid = TRUE;
+}
+
+static LocationBits *
+locations_set_compile(const gchar *location_name)
+{
+	LocationBits *bits = NULL;
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+	guint index = 0;
+
+	bits = (LocationBits *)g_hash_table_lookup(compiled, location_name);
+	if (bits != NULL)
+		return bits;
+
+	if (!locations_model_location_exists(location_name))
+		return NULL;
+
+	bits = g_new0(LocationBits, 1);
+	bits->recorded = g_new0(guint64, n_words);
+	bits->enabled = g_new0(guint64, n_words);
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		index = GPOINTER_TO_UINT(g_hash_table_lookup(account_index, asi->account));
+		if (index-- == 0)
+			continue;
+
+		bits->recorded[index / WORD_BITS] |= G_GUINT64_CONSTANT(1) << (index % WORD_BITS);
+		if (asi->enabled)
+			bits->enabled[index / WORD_BITS] |= G_GUINT64_CONSTANT(1) << (index % WORD_BITS);
+	}
+
+	g_hash_table_insert(compiled, g_strdup(location_name), bits);
+	return bits;
+}
+
+void
+locations_set_init()
+{
+	migrate_last_location = !purple_prefs_exists(PREF_ACTIVE_SET);
+	purple_prefs_add_string_list(PREF_ACTIVE_SET, NULL);
+
+	account_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	indexed_accounts = g_ptr_array_new();
+	account_index_stale = TRUE;
+
+	compiled = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, location_bits_free);
+	compiled_valid = FALSE;
+
+	purple_signal_connect(purple_accounts_get_handle(), "account-added",
+			&handle, PURPLE_CALLBACK(account_index_changed_cb), NULL);
+	purple_signal_connect(purple_accounts_get_handle(), "account-removed",
+			&handle, PURPLE_CALLBACK(account_index_changed_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "location-removed",
+			&handle, PURPLE_CALLBACK(location_removed_cb), NULL);
+}
+
+void
+locations_set_uninit()
+{
+	purple_signals_disconnect_by_handle(&handle);
+
+	locations_set_clear();
+
+	g_hash_table_destroy(compiled);
+	compiled = NULL;
+	g_hash_table_destroy(account_index);
+	account_index = NULL;
+	g_ptr_array_free(indexed_accounts, TRUE);
+	indexed_accounts = NULL;
+
+	g_free(effective_recorded);
+	g_free(effective_enabled);
+	effective_recorded = NULL;
+	effective_enabled = NULL;
+	effective_words = 0;
+}
+
+void
+locations_set_load()
+{
+	GList *entries = NULL,
+		  *item = NULL;
+	gchar *sep = NULL;
+	const gchar *last_location = NULL;
+	LocationsSetOp op;
+
+	locations_set_clear();
+
+	entries = purple_prefs_get_string_list(PREF_ACTIVE_SET);
+	for (item = g_list_first(entries); item != NULL; item = g_list_next(item))
+	{
+		sep = strchr((gchar *)item->data, ':');
+		if (sep != NULL)
+			*sep = '\0';
+
+		if (sep != NULL && locations_set_op_from_string((gchar *)item->data, &op))
+			locations_set_add_layer(sep + 1, op);
+		else
+			purple_debug_warning("locations", "Ignore malformed layer %s\n",
+					(gchar *)item->data);
+
+		g_free(item->data);
+	}
+
+	g_list_free(entries);
+
+	/*
+	 * Profiles from before location sets only remember the last location.
+	 * An empty set saved since then is meant, combining no location.
+	 */
+	if (!migrate_last_location)
+		return;
+	migrate_last_location = FALSE;
+
+	last_location = purple_prefs_get_string(PREF_LAST_LOCATION);
+	if (set_layers == NULL && last_location != NULL &&
+			locations_model_location_exists(last_location))
+		locations_set_add_layer(last_location, LOCATIONS_SET_OVERRIDE);
+}
+
+void
+locations_set_save()
+{
+	GList *entries = NULL,
+		  *item = NULL;
+	LocationsSetLayer *layer = NULL;
+
+	for (item = g_list_first(set_layers); item != NULL; item = g_list_next(item))
+	{
+		layer = (LocationsSetLayer *)item->data;
+		entries = g_list_prepend(entries, g_strdup_printf("%s:%s",
+					locations_set_op_to_string(layer->op), layer->location_name));
+	}
+	entries = g_list_reverse(entries);
+
+	purple_prefs_set_string_list(PREF_ACTIVE_SET, entries);
+
+	g_list_foreach(entries, (GFunc)g_free, NULL);
+	g_list_free(entries);
+}
+
+void
+locations_set_clear()
+{
+	g_list_foreach(set_layers, (GFunc)layer_free, NULL);
+	g_list_free(set_layers);
+	set_layers = NULL;
+}
+
+void
+locations_set_add_layer(const gchar *location_name, LocationsSetOp op)
+{
+	LocationsSetLayer *layer = NULL;
+
+	locations_set_remove_layer(location_name);
+
+	layer = g_new0(LocationsSetLayer, 1);
+	layer->location_name = g_strdup(location_name);
+	layer->op = op;
+	set_layers = g_list_append(set_layers, layer);
+}
+
+gboolean
+locations_set_remove_layer(const gchar *location_name)
+{
+	GList *item = NULL;
+	LocationsSetLayer *layer = NULL;
+
+	for (item = g_list_first(set_layers); item != NULL; item = g_list_next(item))
+	{
+		layer = (LocationsSetLayer *)item->data;
+		if (g_strcmp0(layer->location_name, location_name) == 0)
+		{
+			set_layers = g_list_delete_link(set_layers, item);
+			layer_free(layer);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+GList *
+locations_set_get_layers()
+{
+	return set_layers;
+}
+
+/*
+ * Each account folds the layers that record it, bottom to top. Layers that
+ * do not record an account leave it alone, so an intersection with an
+ * account no lower layer has seen yet just takes the layer's state.
+ */
+gboolean
+locations_set_evaluate()
+{
+	GList *item = NULL;
+	LocationsSetLayer *layer = NULL;
+	LocationBits *bits = NULL;
+	guint64 *rec = NULL,
+			*en = NULL;
+	guint w = 0;
+
+	if (set_layers == NULL)
+		return FALSE;
+
+	locations_set_refresh();
+
+	if (effective_words != n_words)
+	{
+		effective_recorded = g_renew(guint64, effective_recorded, n_words);
+		effective_enabled = g_renew(guint64, effective_enabled, n_words);
+		effective_words = n_words;
+	}
+	memset(effective_recorded, 0, n_words * sizeof(guint64));
+	memset(effective_enabled, 0, n_words * sizeof(guint64));
+
+	for (item = set_layers; item != NULL; item = g_list_next(item))
+	{
+		layer = (LocationsSetLayer *)item->data;
+		bits = locations_set_compile(layer->location_name);
+		if (bits == NULL)
+		{
+			purple_debug_warning("locations", "Location %s of the active set does not exist\n",
+					layer->location_name);
+			effective_words = 0;
+			return FALSE;
+		}
+
+		rec = bits->recorded;
+		en = bits->enabled;
+
+		switch (item == set_layers ? LOCATIONS_SET_OVERRIDE : layer->op)
+		{
+			case LOCATIONS_SET_UNION:
+				for (w = 0; w < n_words; ++w)
+					effective_enabled[w] |= en[w];
+				break;
+			case LOCATIONS_SET_INTERSECT:
+				for (w = 0; w < n_words; ++w)
+					effective_enabled[w] = (effective_enabled[w] & ~rec[w]) |
+						(en[w] & (effective_enabled[w] | ~effective_recorded[w]));
+				break;
+			case LOCATIONS_SET_OVERRIDE:
+				for (w = 0; w < n_words; ++w)
+					effective_enabled[w] = (effective_enabled[w] & ~rec[w]) | en[w];
+				break;
+		}
+
+		for (w = 0; w < n_words; ++w)
+			effective_recorded[w] |= rec[w];
+	}
+
+	return TRUE;
+}
+
+void
+locations_set_foreach_account(LocationsSetAccountFunc func, gpointer data)
+{
+	guint64 word = 0;
+	guint w = 0,
+		  bit = 0;
+
+	for (w = 0; w < effective_words; ++w)
+	{
+		for (word = effective_recorded[w]; word != 0; word &= word - 1)
+		{
+			bit = bitmap_lowest_bit(word);
+			func((PurpleAccount *)g_ptr_array_index(indexed_accounts, w * WORD_BITS + bit),
+					(effective_enabled[w] >> bit) & 1, data);
+		}
+	}
+}
+
+const gchar *
+locations_set_op_to_string(LocationsSetOp op)
+{
+	return op_names[op];
+}
+
+gboolean
+locations_set_op_from_string(const gchar *s, LocationsSetOp *op)
+{
+	guint i = 0;
+
+	for (i = 0; i < G_N_ELEMENTS(op_names); ++i)
+	{
+		if (g_strcmp0(s, op_names[i]) == 0)
+		{
+			*op = (LocationsSetOp)i;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,95 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Location sets: several locations active at once, combined layer by layer.
+ * Every location is compiled into two bitmaps over a dense account index,
+ * the accounts it records and the accounts it enables, and a set is
+ * evaluated with word-wide operations on those bitmaps.
+ */
+
+#ifndef _LOCATIONS_SET_H_
+#define _LOCATIONS_SET_H_
+
+#include <glib.h>
+
+#include <account.h>
+
+#include "locations-model.h"
+
+#define PREF_ACTIVE_SET PREF_LOCATIONS "/active"
+
+typedef enum
+{
+	/* Enable what either side enables. */
+	LOCATIONS_SET_UNION,
+	/* Keep enabled only what the layer enables too. */
+	LOCATIONS_SET_INTERSECT,
+	/* The accounts recorded by the layer take the layer's state. */
+	LOCATIONS_SET_OVERRIDE
+} LocationsSetOp;
+
+typedef struct
+{
+	gchar *location_name;
+	LocationsSetOp op;
+} LocationsSetLayer;
+
+typedef void (*LocationsSetAccountFunc)(PurpleAccount *account, gboolean enabled, gpointer data);
+
+void locations_set_init(void);
+void locations_set_uninit(void);
+
+/* The active set is kept in PREF_ACTIVE_SET as "op:location" strings. */
+void locations_set_load(void);
+void locations_set_save(void);
+
+void locations_set_clear(void);
+
+/*
+ * Append a layer to the active set, or move the location's existing layer
+ * to the top with the new operation. The bottom layer is the base of the
+ * set whatever its operation is. Deleting a location removes its layer
+ * and saves the set.
+ */
+void locations_set_add_layer(const gchar *location_name, LocationsSetOp op);
+gboolean locations_set_remove_layer(const gchar *location_name);
+
+/* The LocationsSetLayer list from bottom to top, owned by the set. */
+GList *locations_set_get_layers(void);
+
+/*
+ * Compute the effective account states of the active set. Returns FALSE if
+ * the set is empty or one of its locations does not exist.
+ */
+gboolean locations_set_evaluate(void);
+
+/*
+ * Call func for every account recorded by any layer of the last evaluated
+ * set, with its effective state.
+ */
+void locations_set_foreach_account(LocationsSetAccountFunc func, gpointer data);
+
+const gchar *locations_set_op_to_string(LocationsSetOp op);
+gboolean locations_set_op_from_string(const gchar *s, LocationsSetOp *op);
+
+#endif /* _LOCATIONS_SET_H_ */
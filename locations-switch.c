@@ -0,0 +1,489 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <account.h>
+#include <connection.h>
+#include <core.h>
+#include <debug.h>
+#include <eventloop.h>
+#include <prefs.h>
+#include <savedstatuses.h>
+#include <signals.h>
+#include <value.h>
+
+#include "locations-drift.h"
+#include "locations-model.h"
+#include "locations-predict.h"
+#include "locations-set.h"
+#include "locations-switch.h"
+
+typedef struct
+{
+	gchar *location_name;	/* Base of the set switched to */
+	GHashTable *pending;	/* Set of the enabled accounts yet to sign on */
+	guint deadline_timer;
+	guint fail_idle;
+
+	/* The state before the first switch, restored by a rollback */
+	GList *snapshot;	/* AccountStateInfo */
+	GHashTable *snapshotted;	/* Set of the accounts in the snapshot */
+	GList *previous_set;	/* PREF_ACTIVE_SET strings */
+	gchar *previous_location;
+	time_t previous_status;
+
+	gboolean fallback;	/* This is the switch to the fallback location */
+	gboolean falling_back;	/* The fallback switch is about to take over */
+} LocationsSwitchTransaction;
+
+static int handle;
+
+static LocationsSwitchTransaction *transaction = NULL;
+
+static void
+locations_switch_transaction_free(LocationsSwitchTransaction *t)
+{
+	if (t->deadline_timer != 0)
+		purple_timeout_remove(t->deadline_timer);
+	if (t->fail_idle != 0)
+		purple_timeout_remove(t->fail_idle);
+
+	g_hash_table_destroy(t->pending);
+	g_list_foreach(t->snapshot, (GFunc)account_state_info_free, NULL);
+	g_list_free(t->snapshot);
+	if (t->snapshotted != NULL)
+		g_hash_table_destroy(t->snapshotted);
+	g_list_foreach(t->previous_set, (GFunc)g_free, NULL);
+	g_list_free(t->previous_set);
+	g_free(t->previous_location);
+	g_free(t->location_name);
+	g_free(t);
+}
+
+static void
+locations_switch_snapshot_account(PurpleAccount *account, gboolean enabled, gpointer data)
+{
+	LocationsSwitchTransaction *t = (LocationsSwitchTransaction *)data;
+
+	/* The first state recorded is the one from before the first switch */
+	if (g_hash_table_lookup(t->snapshotted, account) != NULL)
+		return;
+
+	g_hash_table_insert(t->snapshotted, account, account);
+	t->snapshot = g_list_prepend(t->snapshot, account_state_info_new(account,
+				purple_account_get_enabled(account, purple_core_get_ui())));
+}
+
+/*
+ * Take over the snapshot of the failed switch when falling back, or record
+ * the state the active set is about to change. The accounts only the
+ * fallback changes are added to the snapshot taken over.
+ */
+static LocationsSwitchTransaction *
+locations_switch_transaction_new(LocationsSwitchTransaction *failed)
+{
+	LocationsSwitchTransaction *t = NULL;
+
+	t = g_new0(LocationsSwitchTransaction, 1);
+	t->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if (failed != NULL)
+	{
+		t->snapshot = failed->snapshot;
+		t->snapshotted = failed->snapshotted;
+		t->previous_set = failed->previous_set;
+		t->previous_location = failed->previous_location;
+		t->previous_status = failed->previous_status;
+		t->fallback = TRUE;
+
+		failed->snapshot = NULL;
+		failed->snapshotted = NULL;
+		failed->previous_set = NULL;
+		failed->previous_location = NULL;
+
+		locations_set_foreach_account(locations_switch_snapshot_account, t);
+	}
+	else
+	{
+		/* The active set was changed already, but not saved yet */
+		t->snapshotted = g_hash_table_new(g_direct_hash, g_direct_equal);
+		locations_set_foreach_account(locations_switch_snapshot_account, t);
+		t->previous_set = purple_prefs_get_string_list(PREF_ACTIVE_SET);
+		t->previous_location = g_strdup(purple_prefs_get_string(PREF_LAST_LOCATION));
+		t->previous_status = purple_savedstatus_get_creation_time(purple_savedstatus_get_current());
+	}
+
+	return t;
+}
+
+static void
+locations_switch_rollback(LocationsSwitchTransaction *t)
+{
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+	PurpleSavedStatus *status = NULL;
+	const gchar *ui = NULL;
+
+	ui = purple_core_get_ui();
+
+	purple_prefs_set_string_list(PREF_ACTIVE_SET, t->previous_set);
+	locations_set_load();
+	purple_prefs_set_string(PREF_LAST_LOCATION, t->previous_location);
+
+	locations_drift_begin_switch();
+	for (item = t->snapshot; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		if (purple_account_get_enabled(asi->account, ui) != asi->enabled)
+			purple_account_set_enabled(asi->account, ui, asi->enabled);
+	}
+	locations_drift_end_switch();
+
+	status = purple_savedstatus_find_by_creation_time(t->previous_status);
+	if (status != NULL && status != purple_savedstatus_get_current())
+		purple_savedstatus_activate(status);
+}
+
+/*
+ * Put the accounts of the failed switch that did not sign on back as they
+ * were, the fallback location may not record them.
+ */
+static void
+locations_switch_restore_pending(LocationsSwitchTransaction *t)
+{
+	GHashTable *pending = NULL;
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+	const gchar *ui = NULL;
+
+	ui = purple_core_get_ui();
+
+	/* Disabling them must not look like the switch committing */
+	pending = t->pending;
+	t->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	locations_drift_begin_switch();
+	for (item = t->snapshot; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		if (g_hash_table_lookup(pending, asi->account) != NULL &&
+				purple_account_get_enabled(asi->account, ui) != asi->enabled)
+			purple_account_set_enabled(asi->account, ui, asi->enabled);
+	}
+	locations_drift_end_switch();
+
+	g_hash_table_destroy(pending);
+}
+
+static void
+locations_switch_fail(void)
+{
+	LocationsSwitchTransaction *t = transaction;
+	const gchar *fallback = NULL;
+
+	fallback = purple_prefs_get_string(PREF_FALLBACK_LOCATION);
+	if (!t->fallback && fallback != NULL && *fallback != '\0' &&
+			strcmp(fallback, t->location_name) != 0)
+	{
+		purple_debug_info("locations", "Switch to %s failed, falling back to %s\n",
+				t->location_name, fallback);
+
+		locations_switch_restore_pending(t);
+
+		/* The fallback switch replaces the transaction and frees it */
+		t->falling_back = TRUE;
+		fallback = g_strdup(fallback);
+		if (locations_switch_to(fallback))
+		{
+			purple_signal_emit(&handle, "switch-failed", t->location_name, fallback);
+			locations_switch_transaction_free(t);
+			g_free((gchar *)fallback);
+			return;
+		}
+		g_free((gchar *)fallback);
+		t->falling_back = FALSE;
+	}
+
+	purple_debug_info("locations", "Switch to %s failed, rolling back\n", t->location_name);
+
+	transaction = NULL;
+	locations_switch_rollback(t);
+	purple_signal_emit(&handle, "switch-failed", t->location_name, NULL);
+	locations_switch_transaction_free(t);
+}
+
+/* Remember a committed switch as the last location and learn from it. */
+static void
+locations_switch_record(const gchar *location_name)
+{
+	locations_predict_record(purple_prefs_get_string(PREF_LAST_LOCATION),
+			location_name, locations_predict_current_hour());
+	purple_prefs_set_string(PREF_LAST_LOCATION, location_name);
+}
+
+static void
+locations_switch_commit(void)
+{
+	LocationsSwitchTransaction *t = transaction;
+
+	transaction = NULL;
+	locations_switch_record(t->location_name);
+	purple_signal_emit(&handle, "switch-committed", t->location_name);
+	locations_switch_transaction_free(t);
+}
+
+static gboolean
+locations_switch_deadline_cb(gpointer data)
+{
+	transaction->deadline_timer = 0;
+	locations_switch_fail();
+
+	return FALSE;
+}
+
+static gboolean
+locations_switch_fail_cb(gpointer data)
+{
+	transaction->fail_idle = 0;
+	locations_switch_fail();
+
+	return FALSE;
+}
+
+static void
+signed_on_cb(PurpleConnection *gc, gpointer data)
+{
+	if (transaction == NULL ||
+			!g_hash_table_remove(transaction->pending, purple_connection_get_account(gc)))
+		return;
+
+	if (g_hash_table_size(transaction->pending) == 0 && transaction->fail_idle == 0)
+		locations_switch_commit();
+}
+
+/*
+ * Fail from an idle callback, libpurple still uses the connection after
+ * emitting the error and the rollback may disable its account.
+ */
+static void
+connection_error_cb(PurpleConnection *gc, PurpleConnectionError err,
+		const gchar *desc, gpointer data)
+{
+	if (transaction == NULL || transaction->fail_idle != 0 ||
+			!g_hash_table_lookup(transaction->pending, purple_connection_get_account(gc)))
+		return;
+
+	purple_debug_info("locations", "%s cannot connect: %s\n",
+			purple_account_get_username(purple_connection_get_account(gc)), desc);
+	transaction->fail_idle = purple_timeout_add(0, locations_switch_fail_cb, NULL);
+}
+
+/* An account disabled by hand while waiting is not expected to sign on. */
+static void
+account_disabled_cb(PurpleAccount *account, gpointer data)
+{
+	if (transaction == NULL || !g_hash_table_remove(transaction->pending, account))
+		return;
+
+	if (g_hash_table_size(transaction->pending) == 0 && transaction->fail_idle == 0)
+		locations_switch_commit();
+}
+
+void
+locations_switch_init()
+{
+	purple_prefs_add_int(PREF_CONNECT_DEADLINE, 0);
+	purple_prefs_add_string(PREF_FALLBACK_LOCATION, "");
+
+	purple_signal_register(&handle, "switch-committed",
+			purple_marshal_VOID__POINTER, NULL, 1,
+			purple_value_new(PURPLE_TYPE_STRING));
+	purple_signal_register(&handle, "switch-failed",
+			purple_marshal_VOID__POINTER_POINTER, NULL, 2,
+			purple_value_new(PURPLE_TYPE_STRING),
+			purple_value_new(PURPLE_TYPE_STRING));
+
+	purple_signal_connect(purple_connections_get_handle(), "signed-on",
+			&handle, PURPLE_CALLBACK(signed_on_cb), NULL);
+	purple_signal_connect(purple_connections_get_handle(), "connection-error",
+			&handle, PURPLE_CALLBACK(connection_error_cb), NULL);
+	purple_signal_connect(purple_accounts_get_handle(), "account-disabled",
+			&handle, PURPLE_CALLBACK(account_disabled_cb), NULL);
+}
+
+void
+locations_switch_uninit()
+{
+	/* Unloading keeps the accounts as they are */
+	if (transaction != NULL)
+		locations_switch_transaction_free(transaction);
+	transaction = NULL;
+
+	purple_signals_disconnect_by_handle(&handle);
+	purple_signals_unregister_by_instance(&handle);
+}
+
+void *
+locations_switch_get_handle()
+{
+	return &handle;
+}
+
+gboolean
+locations_switch_in_transaction()
+{
+	return transaction != NULL;
+}
+
+/*
+ * Accounts to be enabled take the location's status while they are still
+ * disabled, so they sign on with it instead of announcing their previous
+ * status and changing it right after. Within a transaction they are
+ * watched until they sign on.
+ */
+static void
+locations_switch_account(PurpleAccount *account, gboolean enabled, gpointer data)
+{
+	PurpleSavedStatus *status = (PurpleSavedStatus *)data;
+	const gchar *ui = NULL;
+
+	ui = purple_core_get_ui();
+
+	if (enabled && status != NULL)
+		purple_savedstatus_activate_for_account(status, account);
+
+	if (purple_account_get_enabled(account, ui) != enabled)
+	{
+		/* Some protocols report errors from within login, already pending then */
+		if (enabled && transaction != NULL)
+			g_hash_table_insert(transaction->pending, account, account);
+		purple_account_set_enabled(account, ui, enabled);
+	}
+}
+
+/* The saved status of the topmost layer that has one, or NULL. */
+static PurpleSavedStatus *
+locations_switch_find_status(void)
+{
+	GList *layer = NULL;
+	const gchar *location_name = NULL;
+	time_t creation_time = 0;
+	PurpleSavedStatus *status = NULL;
+
+	layer = g_list_last(locations_set_get_layers());
+	for (; layer != NULL; layer = g_list_previous(layer))
+	{
+		location_name = ((LocationsSetLayer *)layer->data)->location_name;
+		creation_time = locations_model_get_status(location_name);
+		if (creation_time == 0)
+			continue;
+
+		status = purple_savedstatus_find_by_creation_time(creation_time);
+		if (status != NULL)
+			return status;
+
+		purple_debug_info("locations", "The status of location %s was deleted\n",
+				location_name);
+	}
+
+	return NULL;
+}
+
+gboolean
+locations_switch_to(const gchar *location_name)
+{
+	if (!locations_model_location_exists(location_name))
+		return FALSE;
+
+	locations_set_clear();
+	locations_set_add_layer(location_name, LOCATIONS_SET_OVERRIDE);
+
+	return locations_switch_to_set();
+}
+
+gboolean
+locations_switch_to_set()
+{
+	LocationsSetLayer *base = NULL;
+	PurpleSavedStatus *status = NULL;
+	LocationsSwitchTransaction *previous = NULL;
+	gint deadline = 0;
+
+	if (!locations_set_evaluate())
+		return FALSE;
+
+	/* A new switch ends the running transaction, unless it is its fallback. */
+	previous = transaction;
+	transaction = NULL;
+	if (previous != NULL && !previous->falling_back)
+	{
+		locations_switch_transaction_free(previous);
+		previous = NULL;
+	}
+
+	deadline = purple_prefs_get_int(PREF_CONNECT_DEADLINE);
+	if (deadline > 0)
+		transaction = locations_switch_transaction_new(previous);
+
+	/* Status and enabled state are applied together in one pass over the accounts. */
+	status = locations_switch_find_status();
+	locations_drift_begin_switch();
+	locations_set_foreach_account(locations_switch_account, status);
+	locations_drift_end_switch();
+
+	/*
+	 * Make it the current status too. The accounts of the set already have
+	 * it, so only the others and the status selector change.
+	 */
+	if (status != NULL)
+		purple_savedstatus_activate(status);
+
+	locations_set_save();
+
+	base = (LocationsSetLayer *)g_list_first(locations_set_get_layers())->data;
+	if (transaction == NULL)
+		locations_switch_record(base->location_name);
+	else
+	{
+		transaction->location_name = g_strdup(base->location_name);
+		if (g_hash_table_size(transaction->pending) == 0)
+			locations_switch_commit();
+		else
+			transaction->deadline_timer = purple_timeout_add_seconds(deadline,
+					locations_switch_deadline_cb, NULL);
+	}
+
+	return TRUE;
+}
+
+const gchar *
+locations_switch_get_last_location()
+{
+	return purple_prefs_get_string(PREF_LAST_LOCATION);
+}
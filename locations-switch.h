@@ -0,0 +1,82 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Switch engine: applies a location to the live purple accounts.
+ */
+
+#ifndef _LOCATIONS_SWITCH_H_
+#define _LOCATIONS_SWITCH_H_
+
+#include <glib.h>
+
+#include "locations-model.h"
+
+/*
+ * With a connect deadline, in seconds, a switch is a transaction. It
+ * commits once every account it enabled has signed on, and fails when one
+ * of them reports a connection error or the deadline passes first. A failed
+ * switch goes to the fallback location, once the accounts that did not sign
+ * on are back as they were, or without one restores the accounts, the
+ * active set and the status from before the switch. A failing fallback is
+ * rolled back the same way, including the accounts only it changed. The
+ * last location and the predictions only learn of committed switches. The
+ * deadline 0 turns transactions off.
+ */
+#define PREF_CONNECT_DEADLINE PREF_LOCATIONS "/connect_deadline"
+#define PREF_FALLBACK_LOCATION PREF_LOCATIONS "/fallback"
+
+/*
+ * Register the prefs and the signals of the switch engine. The signals,
+ * emitted on locations_switch_get_handle(), are:
+ *
+ *   switch-committed (const gchar *location_name)
+ *   switch-failed (const gchar *location_name, const gchar *fallback_name),
+ *       where fallback_name is NULL if the switch was rolled back
+ */
+void locations_switch_init(void);
+void locations_switch_uninit(void);
+void *locations_switch_get_handle(void);
+
+/*
+ * Enable and disable the accounts as recorded by the location, and
+ * remember it as the last location once the switch commits. Accounts
+ * already in the recorded state are left alone. Returns FALSE if the location does not exist.
+ *
+ * This makes the location the only layer of the active set.
+ */
+gboolean locations_switch_to(const gchar *location_name);
+
+/*
+ * Apply the effective account states of the active set, see
+ * locations-set.h. The base layer is remembered as the last location.
+ * Returns FALSE if the set is empty or refers to a missing location.
+ */
+gboolean locations_switch_to_set(void);
+
+/* Whether a switch is waiting for its accounts to sign on. */
+gboolean locations_switch_in_transaction(void);
+
+/* The name of the last applied location, or an empty string. */
+const gchar *locations_switch_get_last_location(void);
+
+#endif /* _LOCATIONS_SWITCH_H_ */
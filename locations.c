@@ -20,12 +20,13 @@
  *
  */
 
-#include "internal.h"
-
 #ifdef HAVE_CONFIG_H
 # include <config.h>
 #endif
 
+#include <string.h>
+
+#include <glib.h>
 
 /* This will prevent compiler errors in some instances and is better explained in the
  * how-to documents on the wiki */
@@ -39,46 +40,37 @@
 
 #include <notify.h>
 #include <plugin.h>
+#include <request.h>
+#include <savedstatuses.h>
 #include <version.h>
 #include "prefs.h"
 #include "debug.h"
+#include "signals.h"
+#include "gtkblist.h"
 #include "gtkutils.h"
 
 #include <gtk/gtk.h>
 
+#include "locations-drift.h"
+#include "locations-model.h"
+#include "locations-predict.h"
+#include "locations-prewarm.h"
+#include "locations-set.h"
+#include "locations-switch.h"
+
 #define PLUGIN_ID "locations"
-#define PREF_PREFIX "/plugins/gtk"
-#define PREF_LOCATIONS PREF_PREFIX "/locations"
-#define PREF_LOCATION_ACCOUNT_MAP PREF_LOCATIONS "/map"
-#define PREF_LAST_LOCATION PREF_LOCATIONS "/last"
 
 #define LOCATION_NAME_MAX_LENGTH 30
 
+/* Marks the active location in the menu when accounts drifted from it */
+#define LOCATION_MODIFIED_SUFFIX " (modified)"
+
 #define LOCATION_NAME_TIP "Location name only contains letters (either upper or lower case), digits, space, dash and underscore."
 
 PurplePlugin *locations_plugin = NULL;
 
-typedef struct
-{
-	PurpleAccount *account;
-	gboolean enabled;
-} AccountStateInfo;
-
-static GHashTable *locations_model = NULL;
-
-static AccountStateInfo *account_state_info_new(PurpleAccount *account, gboolean enabled);
-static void account_state_info_free(AccountStateInfo *asi);
-
-/* Locations model functions */
-static void locations_model_load(void);
-static void locations_model_save(void);
-static void locations_model_free(void);
-static GList *locations_model_get_locations_names(void);
-static GList *locations_model_lookup_accounts(gchar *location_name);
-static gboolean locations_model_location_exists(gchar *name);
-static void locations_model_add_location(gchar *name, GList *asis);
-static gboolean locations_model_delete_location(gchar *location_name);
-/*****************************/
+/* Names of the locations of the "Location:" actions, owned for their user_data */
+static GList *action_locations = NULL;
 
 /* UI-specific functions */
 typedef struct
@@ -89,7 +81,12 @@ typedef struct
 	GtkWidget *btnAdd;
 	GtkWidget *btnSave;
 	GtkWidget *btnDelete;
+	GtkWidget *btnBulk;
 	GtkWidget *btnClose;
+
+	GHashTable *pending;	/* Names of the locations changed since the last sync */
+	gboolean pending_reload;
+	guint sync_source;
 }
 LocationConfigurationDialog;
 
@@ -106,274 +103,372 @@ static LocationConfigurationDialog *configure_dialog = NULL;
 static void location_configure_dialog_create(void);
 static void location_configure_dialog_destroy(void);
 static void location_configure_dialog_show(void);
+static void location_configure_dialog_sync(void);
 static gchar *location_configure_dialog_get_new_location_name(GtkWidget *parent);
 static void add_clicked_handler(GtkButton *button, gpointer data);
 static void save_clicked_handler(GtkButton *button, gpointer data);
 static void delete_clicked_handler(GtkButton *button, gpointer data);
 static void cboLocations_changed_handler(GtkComboBox *sender, gpointer data);
+static void bulk_clicked_handler(GtkButton *button, gpointer data);
+static gchar *location_configure_dialog_get_active_location(LocationConfigurationDialog *dialog);
+static void location_configure_dialog_refresh_accounts(LocationConfigurationDialog *dialog,
+		const gchar *location_name);
+static void location_configure_dialog_commit_accounts(LocationConfigurationDialog *dialog,
+		const gchar *location_name);
+static GList *location_configure_dialog_choose_locations(GtkWidget *parent, const gchar *exclude);
 
 static GtkWidget *create_gtk_combo_box(GList *initial_strings);
-static void gtk_combo_box_locate_iter(GtkTreeModel *model, const gchar *string, GtkTreeIter *iter);
+static gboolean gtk_combo_box_locate_iter(GtkTreeModel *model, const gchar *string, GtkTreeIter *iter);
 static void gtk_combo_box_select_string(GtkWidget *combo_box, const gchar *s);
 static void gtk_combo_box_add_string(GtkWidget *combo_box, gchar *string);
-static void gtk_combo_box_remove_string(GtkWidget *combo_box, const gchar *string);
 /****************/
 
-static AccountStateInfo *
-account_state_info_new(PurpleAccount *account, gboolean enabled)
-{
-	AccountStateInfo *asi = NULL;
-
-	asi = g_new0(AccountStateInfo, 1);
-	asi->account = account;
-	asi->enabled = enabled;
-
-	return asi;
-}
-
-static void
-account_state_info_free(AccountStateInfo *asi)
-{
-	if (asi == NULL) return;
-	g_free(asi);
-}
-
-/* Locations model functions */
+/* UI-specific functions */
 
-static void locations_model_load()
+static GtkWidget *
+create_gtk_combo_box(GList *initial_strings)
 {
-	GList *map = NULL,
-		  *item = NULL;
-	gchar **fields = NULL;
-	GList *account_list = NULL;
-	AccountStateInfo *asi = NULL;
-
-	locations_model = g_hash_table_new_full(g_str_hash, g_str_equal,
-			g_free, /* free the Key */
-			NULL
-			); 
-
-	map = purple_prefs_get_string_list(PREF_LOCATION_ACCOUNT_MAP);
-	if (map == NULL)
-		return;
+	GtkWidget *combo_box = NULL;
+	GtkListStore *store = NULL;
+	GtkTreeIter iter;
+	GtkCellRenderer *renderer = NULL;
+	GList *item = NULL;
 
-	for (item = g_list_first(map); item != NULL; item = g_list_next(item))
+	store = gtk_list_store_new(1, G_TYPE_STRING);
+	for (item = g_list_first(initial_strings); item != NULL; item = g_list_next(item))
 	{
-		fields = g_strsplit((gchar *)item->data, ":", -1);
-
-		asi = g_new0(AccountStateInfo, 1);
-		asi->account = purple_accounts_find(*(fields + 1), *(fields + 2));
-		asi->enabled = g_strcmp0(*(fields + 3), "enabled") == 0 ? TRUE : FALSE;
-
-		account_list = (GList *)g_hash_table_lookup(locations_model, *fields);
-		account_list = g_list_append(account_list, asi);
-		g_hash_table_insert(locations_model, g_strdup(*fields), account_list);
-
-		g_free((gchar *)item->data);
-		g_strfreev(fields);
+		gtk_list_store_append(store, &iter);
+		gtk_list_store_set(store, &iter, 0, (gchar *)item->data, -1);
 	}
 
-	g_list_free(map);
+	combo_box = gtk_combo_box_new_with_model(GTK_TREE_MODEL(store));
+	renderer = gtk_cell_renderer_text_new();
+	gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(combo_box), renderer, TRUE);
+	gtk_cell_layout_set_attributes(GTK_CELL_LAYOUT(combo_box), renderer, "text", 0, NULL);
+	return combo_box;
 }
 
-static void locations_model_save()
+static gboolean
+gtk_combo_box_locate_iter(GtkTreeModel *model, const gchar *string, GtkTreeIter *iter)
 {
-	GList *keys = NULL,
-		  *key_item = NULL,
-		  *values = NULL,
-		  *value_item = NULL,
-		  *mapping = NULL,
-		  *item = NULL;
-	AccountStateInfo *asi = NULL;
+	gchar *text = NULL;
+	gboolean end_search = FALSE;
 
-	keys = locations_model_get_locations_names();
-	key_item = g_list_first(keys);
-	for (; key_item != NULL; key_item = g_list_next(key_item))
+	if (gtk_tree_model_get_iter_first(model, iter))
 	{
-		values = locations_model_lookup_accounts((gchar *)key_item->data);
-		value_item = g_list_first(values);
-		for (; value_item != NULL; value_item = g_list_next(value_item))
+		do
 		{
-			asi = (AccountStateInfo *)value_item->data;
-			mapping = g_list_append(mapping,
-					g_strdup_printf("%s:%s:%s:%s",
-						(gchar *)key_item->data,
-						purple_account_get_username(asi->account),
-						purple_account_get_protocol_id(asi->account),
-						asi->enabled ? "enabled" : "disabled"));
+			gtk_tree_model_get(model, iter, 0, &text, -1);
+			end_search = g_strcmp0(text, string) == 0;
+			g_free(text);
 		}
+		while (!end_search && gtk_tree_model_iter_next(model, iter));
 	}
 
-	purple_prefs_set_string_list(PREF_LOCATION_ACCOUNT_MAP, mapping);
-
-	/* TODO: refactoring the GList free procedure */
-	for (item = g_list_first(mapping); item != NULL; item = g_list_next(item))
-		g_free((gchar *)item->data);
-
-	g_list_free(mapping);
-}
-
-static gboolean
-locations_model_location_exists(gchar *name)
-{
-	return NULL != g_hash_table_lookup(locations_model, name);
+	return end_search;
 }
 
 static void
-locations_model_add_location(gchar *name, GList *asis)
+gtk_combo_box_select_string(GtkWidget *combo_box, const gchar *s)
 {
-	g_hash_table_insert(locations_model, g_strdup(name), asis);
-}
+	GtkTreeModel *model;
+	GtkTreeIter iter;
 
-static void
-locations_model_free_account_info_cb(gpointer data, gpointer user_data)
-{
-	account_state_info_free((AccountStateInfo *)data);
+	model = gtk_combo_box_get_model(GTK_COMBO_BOX(combo_box));
+	if (gtk_combo_box_locate_iter(model, s, &iter))
+		gtk_combo_box_set_active_iter(GTK_COMBO_BOX(combo_box), &iter);
 }
 
-static gboolean
-locations_model_foreach_free_cb(gpointer key, gpointer value, gpointer data)
+static void
+gtk_combo_box_add_string(GtkWidget *combo_box, gchar *string)
 {
-	g_list_foreach((GList *)value, locations_model_free_account_info_cb, NULL);
-	g_list_free((GList *)value);
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
 
-	return TRUE;
+	model = gtk_combo_box_get_model(GTK_COMBO_BOX(combo_box));
+	if (model != NULL)
+	{
+		gtk_list_store_append(GTK_LIST_STORE(model), &iter);
+		gtk_list_store_set(GTK_LIST_STORE(model), &iter, 0, string, -1);
+	}
 }
 
-static void locations_model_free()
+/*** End of UI-specific functions ***/
+
+static void
+plugin_action_configure_cb (PurplePluginAction * action)
 {
-	g_hash_table_foreach_remove(locations_model, locations_model_foreach_free_cb, NULL);
-	g_hash_table_destroy(locations_model);
-	locations_model = NULL;
+	/* The dialog is built on first use and only hidden when closed. */
+	if (configure_dialog == NULL)
+		location_configure_dialog_create();
+
+	location_configure_dialog_show();
 }
 
-static GList *locations_model_get_locations_names()
+/* The action carries the name of its location, the label may be decorated. */
+static void
+plugin_action_configure_accounts_by_location_cb(PurplePluginAction *action)
 {
-	return g_hash_table_get_keys(locations_model);
+	locations_switch_to((gchar *)action->user_data);
 }
 
-static GList *
-locations_model_lookup_accounts(gchar *location_name)
+static void
+plugin_action_save_drift_cb(PurplePluginAction *action)
 {
-	return (GList *)g_hash_table_lookup(locations_model, location_name);
+	locations_drift_save();
+	locations_model_save();
 }
 
-static gboolean
-locations_model_delete_location(gchar *location_name)
+static void
+plugin_action_reapply_drift_cb(PurplePluginAction *action)
 {
-	return g_hash_table_remove(locations_model, location_name);
+	locations_drift_reapply();
 }
-/*** End of locations model functions ***/
-
-/* UI-specific functions */
 
-static GtkWidget *
-create_gtk_combo_box(GList *initial_strings)
+/* The choices of a location in the Combine dialog: not active, then one per LocationsSetOp. */
+static gint
+location_set_choice(const gchar *location_name)
 {
-	GtkWidget *combo_box = NULL;
-	GtkListStore *store = NULL;
-	GtkTreeIter iter;
-	GtkCellRenderer *renderer = NULL;
 	GList *item = NULL;
+	LocationsSetLayer *layer = NULL;
 
-	store = gtk_list_store_new(1, G_TYPE_STRING);
-	for (item = g_list_first(initial_strings); item != NULL; item = g_list_next(item))
+	for (item = g_list_first(locations_set_get_layers()); item != NULL; item = g_list_next(item))
 	{
-		gtk_list_store_append(store, &iter);
-		gtk_list_store_set(store, &iter, 0, (gchar *)item->data, -1);
+		layer = (LocationsSetLayer *)item->data;
+		if (g_strcmp0(layer->location_name, location_name) == 0)
+			return layer->op + 1;
 	}
 
-	combo_box = gtk_combo_box_new_with_model(GTK_TREE_MODEL(store));
-	renderer = gtk_cell_renderer_text_new();
-	gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(combo_box), renderer, TRUE);
-	gtk_cell_layout_set_attributes(GTK_CELL_LAYOUT(combo_box), renderer, "text", 0, NULL);
-	return combo_box;
+	return 0;
 }
 
 static void
-gtk_combo_box_locate_iter(GtkTreeModel *model, const gchar *string, GtkTreeIter *iter)
+plugin_action_combine_ok_cb(gpointer data, PurpleRequestFields *fields)
 {
-	gchar *text = NULL;
-	gboolean end_search = FALSE;
+	GList *locations = NULL,
+		  *item = NULL;
+	gint op = 0;
 
-	if (gtk_tree_model_get_iter_first(model, iter))
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+
+	/* Unions at the bottom, then intersections, and overrides take precedence. */
+	locations_set_clear();
+	for (op = LOCATIONS_SET_UNION; op <= LOCATIONS_SET_OVERRIDE; ++op)
 	{
-		do
+		for (item = locations; item != NULL; item = g_list_next(item))
 		{
-			gtk_tree_model_get(model, iter, 0, &text, -1);
-			end_search = g_strcmp0(text, string) == 0;
-			g_free(text);
+			if (purple_request_fields_get_choice(fields, (gchar *)item->data) == op + 1)
+				locations_set_add_layer((gchar *)item->data, (LocationsSetOp)op);
 		}
-		while (!end_search && gtk_tree_model_iter_next(model, iter));
+	}
+	g_list_free(locations);
+
+	if (locations_set_get_layers() != NULL)
+		locations_switch_to_set();
+	else
+	{
+		/* Nothing is expected of the accounts any more. */
+		locations_set_save();
+		locations_drift_recompute();
 	}
 }
 
 static void
-gtk_combo_box_select_string(GtkWidget *combo_box, const gchar *s)
+plugin_action_combine_cb(PurplePluginAction *action)
 {
-	GtkTreeModel *model;
-	GtkTreeIter iter;
+	PurpleRequestFields *fields = NULL;
+	PurpleRequestFieldGroup *group = NULL;
+	PurpleRequestField *field = NULL;
+	GList *locations = NULL,
+		  *item = NULL;
 
-	model = gtk_combo_box_get_model(GTK_COMBO_BOX(combo_box));
-	gtk_combo_box_locate_iter(model, s, &iter);
-	gtk_combo_box_set_active_iter(GTK_COMBO_BOX(combo_box), &iter);
+	fields = purple_request_fields_new();
+	group = purple_request_field_group_new(NULL);
+	purple_request_fields_add_group(fields, group);
+
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+	for (item = locations; item != NULL; item = g_list_next(item))
+	{
+		field = purple_request_field_choice_new((gchar *)item->data, (gchar *)item->data,
+				location_set_choice((gchar *)item->data));
+		purple_request_field_choice_add(field, "Not active");
+		purple_request_field_choice_add(field, "Union");
+		purple_request_field_choice_add(field, "Intersect");
+		purple_request_field_choice_add(field, "Override");
+		purple_request_field_group_add_field(group, field);
+	}
+	g_list_free(locations);
+
+	purple_request_fields(action->plugin,
+			"Combine Locations",
+			"Activate several locations at once",
+			"Unions are combined first, then intersections, and overrides take precedence over both.",
+			fields,
+			"_Apply", G_CALLBACK(plugin_action_combine_ok_cb),
+			"_Cancel", NULL,
+			NULL, NULL, NULL,
+			NULL);
 }
 
 static void
-gtk_combo_box_add_string(GtkWidget *combo_box, gchar *string)
+plugin_action_status_add_choice(gpointer data, gpointer user_data)
 {
-	GtkTreeModel *model = NULL;
-	GtkTreeIter iter;
+	purple_request_field_choice_add((PurpleRequestField *)user_data,
+			purple_savedstatus_get_title((PurpleSavedStatus *)data));
+}
 
-	model = gtk_combo_box_get_model(GTK_COMBO_BOX(combo_box));
-	if (model != NULL)
+static void
+plugin_action_status_ok_cb(gpointer data, PurpleRequestFields *fields)
+{
+	GArray *statuses = (GArray *)data;
+	GList *locations = NULL,
+		  *item = NULL;
+	PurpleRequestField *field = NULL;
+	gint choice = 0;
+
+	locations = locations_model_get_locations_names();
+	for (item = locations; item != NULL; item = g_list_next(item))
 	{
-		gtk_list_store_append(GTK_LIST_STORE(model), &iter);
-		gtk_list_store_set(GTK_LIST_STORE(model), &iter, 0, string, -1);
+		/* Only what was changed, a status missing from the choices is kept */
+		field = purple_request_fields_get_field(fields, (gchar *)item->data);
+		if (field == NULL)
+			continue;
+
+		choice = purple_request_field_choice_get_value(field);
+		if (choice != purple_request_field_choice_get_default_value(field))
+			locations_model_set_status((gchar *)item->data,
+					g_array_index(statuses, time_t, choice));
 	}
+	g_list_free(locations);
+
+	g_array_free(statuses, TRUE);
+	locations_model_save();
 }
 
 static void
-gtk_combo_box_remove_string(GtkWidget *combo_box, const gchar *string)
+plugin_action_status_cancel_cb(gpointer data, PurpleRequestFields *fields)
 {
-	GtkTreeModel *model = NULL;
-	GtkTreeIter iter;
-
-	model = gtk_combo_box_get_model(GTK_COMBO_BOX(combo_box));
-	gtk_combo_box_locate_iter(model, string, &iter);
-	gtk_list_store_remove(GTK_LIST_STORE(combo_box), &iter);
+	g_array_free((GArray *)data, TRUE);
 }
 
-/*** End of UI-specific functions ***/
+static void
+plugin_action_status_cb(PurplePluginAction *action)
+{
+	PurpleRequestFields *fields = NULL;
+	PurpleRequestFieldGroup *group = NULL;
+	PurpleRequestField *field = NULL;
+	GList *locations = NULL,
+		  *saved = NULL,
+		  *item = NULL;
+	GArray *statuses = NULL;	/* The time_t of each choice, 0 keeps the current status */
+	time_t creation_time = 0;
+	guint i = 0,
+		  choice = 0;
+
+	statuses = g_array_new(FALSE, FALSE, sizeof(time_t));
+	g_array_append_val(statuses, creation_time);
+
+	saved = purple_savedstatuses_get_popular(0);
+	for (item = saved; item != NULL; item = g_list_next(item))
+	{
+		creation_time = purple_savedstatus_get_creation_time((PurpleSavedStatus *)item->data);
+		g_array_append_val(statuses, creation_time);
+	}
+
+	fields = purple_request_fields_new();
+	group = purple_request_field_group_new(NULL);
+	purple_request_fields_add_group(fields, group);
+
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+	for (item = locations; item != NULL; item = g_list_next(item))
+	{
+		creation_time = locations_model_get_status((gchar *)item->data);
+		for (choice = 0, i = 1; i < statuses->len; ++i)
+		{
+			if (creation_time != 0 && g_array_index(statuses, time_t, i) == creation_time)
+				choice = i;
+		}
+
+		field = purple_request_field_choice_new((gchar *)item->data, (gchar *)item->data, choice);
+		purple_request_field_choice_add(field, "Keep current status");
+		g_list_foreach(saved, plugin_action_status_add_choice, field);
+		purple_request_field_group_add_field(group, field);
+	}
+	g_list_free(locations);
+	g_list_free(saved);
+
+	purple_request_fields(action->plugin,
+			"Location Status",
+			"Sign on with a saved status at each location",
+			"Accounts enabled by a switch connect with the status of the location.",
+			fields,
+			"_Apply", G_CALLBACK(plugin_action_status_ok_cb),
+			"_Cancel", G_CALLBACK(plugin_action_status_cancel_cb),
+			NULL, NULL, NULL,
+			statuses);
+}
 
 static void
-plugin_action_configure_cb (PurplePluginAction * action)
+plugin_action_fallback_ok_cb(gpointer data, PurpleRequestFields *fields)
 {
-  location_configure_dialog_create();
-  location_configure_dialog_show();
-  location_configure_dialog_destroy();
+	GList *locations = NULL;
+	gint choice = 0;
+
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE,
+			MAX(purple_request_fields_get_int(fields, "deadline"), 0));
+
+	/* The first choice rolls back instead of falling back */
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+	choice = purple_request_fields_get_choice(fields, "fallback");
+	purple_prefs_set_string(PREF_FALLBACK_LOCATION,
+			choice > 0 ? (gchar *)g_list_nth_data(locations, choice - 1) : "");
+	g_list_free(locations);
 }
 
 static void
-plugin_action_configure_accounts_by_location_cb(PurplePluginAction *action)
+plugin_action_fallback_cb(PurplePluginAction *action)
 {
-	gchar **fields = NULL;
-	GList *asis = NULL,
+	PurpleRequestFields *fields = NULL;
+	PurpleRequestFieldGroup *group = NULL;
+	PurpleRequestField *field = NULL;
+	GList *locations = NULL,
 		  *item = NULL;
-	AccountStateInfo *asi = NULL;
+	const gchar *fallback = NULL;
+	gint choice = 0,
+		 i = 0;
 
-	fields = g_strsplit(action->label, ": ", -1);
-	asis = locations_model_lookup_accounts(*(fields+1));
+	fields = purple_request_fields_new();
+	group = purple_request_field_group_new(NULL);
+	purple_request_fields_add_group(fields, group);
 
-	for (item = g_list_first(asis); item != NULL; item = g_list_next(item))
+	field = purple_request_field_int_new("deadline", "Connect deadline in seconds, 0 waits forever",
+			purple_prefs_get_int(PREF_CONNECT_DEADLINE));
+	purple_request_field_group_add_field(group, field);
+
+	fallback = purple_prefs_get_string(PREF_FALLBACK_LOCATION);
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+	for (item = locations, i = 1; item != NULL; item = g_list_next(item), ++i)
 	{
-		asi = (AccountStateInfo *)item->data;
-		purple_account_set_enabled(asi->account, PIDGIN_UI, asi->enabled);
+		if (g_strcmp0((gchar *)item->data, fallback) == 0)
+			choice = i;
 	}
 
-	purple_prefs_set_string(PREF_LAST_LOCATION, *(fields+1));
+	field = purple_request_field_choice_new("fallback", "On failure", choice);
+	purple_request_field_choice_add(field, "Restore the previous accounts");
+	for (item = locations; item != NULL; item = g_list_next(item))
+		purple_request_field_choice_add(field, (gchar *)item->data);
+	purple_request_field_group_add_field(group, field);
+	g_list_free(locations);
 
-	g_strfreev(fields);
+	purple_request_fields(action->plugin,
+			"Switch Fallback",
+			"Bound the time a switch may take to connect",
+			"A switch fails when an account it enabled reports a connection error or has not signed on by the deadline.",
+			fields,
+			"_Apply", G_CALLBACK(plugin_action_fallback_ok_cb),
+			"_Cancel", NULL,
+			NULL, NULL, NULL,
+			NULL);
 }
 
 static GList *
@@ -383,22 +478,54 @@ plugin_actions (PurplePlugin * plugin, gpointer context)
 		  *locations = NULL,
 		  *item = NULL;
 	gchar *action_name = NULL;
+	const gchar *last_location = NULL;
+	gboolean modified = FALSE;
 	PurplePluginAction *action = NULL;
 
+	last_location = locations_switch_get_last_location();
+	modified = locations_drift_get_count() > 0;
+
 	action = purple_plugin_action_new ("Configure", plugin_action_configure_cb);
 	list = g_list_append (list, action);
 
+	action = purple_plugin_action_new ("Combine Locations...", plugin_action_combine_cb);
+	list = g_list_append (list, action);
+
+	action = purple_plugin_action_new ("Location Status...", plugin_action_status_cb);
+	list = g_list_append (list, action);
+
+	action = purple_plugin_action_new ("Switch Fallback...", plugin_action_fallback_cb);
+	list = g_list_append (list, action);
+
+	/* The actions of the previous menu are gone once it is rebuilt. */
+	g_list_foreach(action_locations, (GFunc)g_free, NULL);
+	g_list_free(action_locations);
+	action_locations = NULL;
+
 	/* Add actions per location */
 	locations = locations_model_get_locations_names();
 	for (item = g_list_first(locations); item != NULL; item = g_list_next(item))
 	{
-		action_name = g_strdup_printf("Location: %s", (gchar *)item->data);
+		action_name = g_strdup_printf("Location: %s%s", (gchar *)item->data,
+				modified && g_strcmp0(item->data, last_location) == 0 ?
+				LOCATION_MODIFIED_SUFFIX : "");
 		action = purple_plugin_action_new (action_name, plugin_action_configure_accounts_by_location_cb);
+		action_locations = g_list_prepend(action_locations, g_strdup((gchar *)item->data));
+		action->user_data = action_locations->data;
 		list = g_list_append (list, action);
 		g_free(action_name);
 	}
 	g_list_free(locations);
 
+	if (modified)
+	{
+		action = purple_plugin_action_new ("Save Changes to Location", plugin_action_save_drift_cb);
+		list = g_list_append (list, action);
+
+		action = purple_plugin_action_new ("Re-apply Location", plugin_action_reapply_drift_cb);
+		list = g_list_append (list, action);
+	}
+
 	return list;
 }
 
@@ -422,9 +549,6 @@ account_status_toggled(GtkCellRenderer *renderer, gchar *path, gpointer data)
 static void
 add_clicked_handler(GtkButton *button, gpointer data)
 {
-	GList *asis = NULL,
-		  *cur_accounts = NULL,
-		  *account_item = NULL;
 	gchar *name = NULL;
 
 	LocationConfigurationDialog *configure_dialog = NULL;
@@ -433,27 +557,19 @@ add_clicked_handler(GtkButton *button, gpointer data)
 
 	name = location_configure_dialog_get_new_location_name(configure_dialog->dialog);
 	if (name == NULL || strlen(name) == 0)
-		return;
-
-	/* Add new location to locations model */
-	cur_accounts = purple_accounts_get_all();
-	account_item = g_list_first(cur_accounts);
-	for (; account_item != NULL; account_item = g_list_next(account_item))
 	{
-		asis = g_list_append(asis,
-			   account_state_info_new(
-				   (PurpleAccount *)account_item->data,
-				   purple_account_get_enabled(
-					   (PurpleAccount *)account_item->data,
-					   PIDGIN_UI)));
+		g_free(name);
+		return;
 	}
-	locations_model_add_location(name, asis);
 
-	/* Add new location name to locations list */
-	gtk_combo_box_add_string(configure_dialog->cboLocations, name);
+	/* Add new location to locations model, and bring the locations list up to date */
+	locations_model_add_location_from_current(name);
+	location_configure_dialog_sync();
 
 	/* Select the new location, and the account list will auto-refresh after selecting. */
 	gtk_combo_box_select_string(configure_dialog->cboLocations, name);
+
+	g_free(name);
 }
 
 /*
@@ -464,60 +580,15 @@ add_clicked_handler(GtkButton *button, gpointer data)
 static void
 save_clicked_handler(GtkButton *button, gpointer data)
 {
-	GtkTreeModel *model = NULL;
-	GtkTreeIter iter;
-	gchar *loc_name = NULL,
-		  *username = NULL,
-		  *protocol_id = NULL;
 	LocationConfigurationDialog *configure_dialog = NULL;
-	gboolean enabled = FALSE,
-			 update_item_found = FALSE;
-	GList *update_asis = NULL,
-		  *item = NULL;
-	AccountStateInfo *asi = NULL;
+	gchar *loc_name = NULL;
 
 	configure_dialog = (LocationConfigurationDialog *)data;
-	model = gtk_combo_box_get_model(GTK_COMBO_BOX(configure_dialog->cboLocations));
-	gtk_combo_box_get_active_iter(GTK_COMBO_BOX(configure_dialog->cboLocations), &iter);
-	gtk_tree_model_get(model, &iter, 0, &loc_name, -1);
-
-	update_asis = locations_model_lookup_accounts(loc_name);
-	model = gtk_tree_view_get_model(GTK_TREE_VIEW(configure_dialog->tvAccounts));
-
-	if (gtk_tree_model_get_iter_first(model, &iter))
-	{
-		do
-		{
-			gtk_tree_model_get(model, &iter, 0, &enabled, 1, &username, 2, &protocol_id, -1);
-
-			for (item = g_list_first(update_asis); item != NULL; item = g_list_next(item))
-			{
-				asi = (AccountStateInfo *)item->data;
-				update_item_found =
-					g_strcmp0(username, purple_account_get_username(asi->account)) == 0 &&
-					g_strcmp0(protocol_id, purple_account_get_protocol_id(asi->account)) == 0;
-				if (update_item_found)
-					break;
-			}
-
-			if (update_item_found)
-			{
-				asi->enabled = enabled;
-			}
-			else
-			{
-				asi = g_new0(AccountStateInfo, 1);
-				asi->enabled = enabled;
-				asi->account = purple_accounts_find(username, protocol_id);
-				/* Put the AccountStateInfo list back to the locations model with new Purple account. */
-				locations_model_add_location(loc_name, g_list_append(update_asis, asi));
-			}
+	loc_name = location_configure_dialog_get_active_location(configure_dialog);
+	if (loc_name == NULL)
+		return;
 
-			g_free(username);
-			g_free(protocol_id);
-		}
-		while (gtk_tree_model_iter_next(model, &iter));
-	}
+	location_configure_dialog_commit_accounts(configure_dialog, loc_name);
 
 	g_free(loc_name);
 }
@@ -545,10 +616,9 @@ delete_clicked_handler(GtkButton *button, gpointer data)
 
 	if (gtk_dialog_run(GTK_DIALOG(msg_dialog)) == GTK_RESPONSE_YES)
 	{
-
+		/* Syncing removes it from the locations list and clears the accounts. */
 		locations_model_delete_location(name);
-		gtk_list_store_remove(GTK_LIST_STORE(model), &iter);
-		gtk_tree_view_set_model(GTK_TREE_VIEW(configure_dialog->tvAccounts), NULL);
+		location_configure_dialog_sync();
 	}
 
 	g_free(name);
@@ -561,61 +631,687 @@ cboLocations_changed_handler(GtkComboBox *sender, gpointer data)
 {
 	LocationConfigurationDialog *configure_dialog = NULL;
 	gboolean selected = FALSE;
-	GtkListStore *store = NULL;
-	GtkTreeIter iter;
-	GtkTreeModel *model = NULL;
 	gchar *location_name = NULL;
-	GList *ls = NULL,
-		  *item = NULL;
-	AccountStateInfo *asi = NULL;
 
 	configure_dialog = (LocationConfigurationDialog *)data;
 	selected = gtk_combo_box_get_active(sender) > -1;
 
 	gtk_widget_set_sensitive(configure_dialog->btnSave, selected);
 	gtk_widget_set_sensitive(configure_dialog->btnDelete, selected);
+	gtk_widget_set_sensitive(configure_dialog->btnBulk, selected);
 
-	if (!selected) return;
-
-	model = gtk_combo_box_get_model(sender);
-	gtk_combo_box_get_active_iter(sender, &iter);
-	gtk_tree_model_get(model, &iter, 0, &location_name, -1);
-
-	store = gtk_list_store_new(3, G_TYPE_BOOLEAN, G_TYPE_STRING, G_TYPE_STRING);
-	ls = locations_model_lookup_accounts(location_name);
-	for (item = g_list_first(ls); item != NULL; item = g_list_next(item))
+	if (!selected)
 	{
-		asi = (AccountStateInfo *)item->data;
-		gtk_list_store_append(store, &iter);
-		gtk_list_store_set(store, &iter,
-				0, asi->enabled,
-				1, purple_account_get_username(asi->account),
-				2, purple_account_get_protocol_id(asi->account),
-				-1);
+		gtk_tree_view_set_model(GTK_TREE_VIEW(configure_dialog->tvAccounts), NULL);
+		return;
 	}
-	gtk_tree_view_set_model(
-			GTK_TREE_VIEW(configure_dialog->tvAccounts),
-		   	GTK_TREE_MODEL(store));
 
+	location_name = location_configure_dialog_get_active_location(configure_dialog);
+	location_configure_dialog_refresh_accounts(configure_dialog, location_name);
 	g_free(location_name);
 }
 
-/******* end of signal handlers *******/
-
-static void
-location_configure_dialog_create()
+/*
+ * Bulk edits work on the saved locations, in one model batch: the model
+ * notifies once, the locations are saved once and the view is synced once.
+ * The rows of the accounts an edit touched then show the saved state, the
+ * unsaved changes of the other rows are left alone.
+ */
+static gchar *
+bulk_edit_begin(LocationConfigurationDialog *dialog)
 {
-	GtkWidget *content_area = NULL,
-			  *label = NULL,
-			  *hbox = NULL;
-	GtkWidget *scrolled_win = NULL;
-	GtkCellRenderer *renderer = NULL;
-	GtkTreeViewColumn *column = NULL;
-	int width, height;
+	gchar *location_name = NULL;
 
-	configure_dialog = g_new0(LocationConfigurationDialog, 1);
+	location_name = location_configure_dialog_get_active_location(dialog);
+	if (location_name != NULL)
+		locations_model_begin_batch();
 
-	configure_dialog->tvAccounts = gtk_tree_view_new();
+	return location_name;
+}
+
+/* The set of the accounts a location records, only those of protocol_id unless it is NULL. */
+static GHashTable *
+bulk_edit_accounts(const gchar *location_name, const gchar *protocol_id)
+{
+	GHashTable *accounts = NULL;
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+
+	accounts = g_hash_table_new(g_direct_hash, g_direct_equal);
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		if (protocol_id == NULL ||
+				g_strcmp0(purple_account_get_protocol_id(asi->account), protocol_id) == 0)
+			g_hash_table_insert(accounts, asi->account, asi);
+	}
+
+	return accounts;
+}
+
+/* Show the saved state in the rows of the touched accounts, a set that may be NULL. */
+static void
+bulk_edit_finish(LocationConfigurationDialog *dialog, gchar *location_name,
+		GHashTable *touched)
+{
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
+	GHashTable *saved = NULL;
+	PurpleAccount *account = NULL;
+	AccountStateInfo *asi = NULL;
+
+	locations_model_end_batch();
+	locations_model_save();
+	location_configure_dialog_sync();
+
+	model = gtk_tree_view_get_model(GTK_TREE_VIEW(dialog->tvAccounts));
+	if (touched != NULL && model != NULL && gtk_tree_model_get_iter_first(model, &iter))
+	{
+		saved = bulk_edit_accounts(location_name, NULL);
+		do
+		{
+			gtk_tree_model_get(model, &iter, 3, &account, -1);
+			asi = (AccountStateInfo *)g_hash_table_lookup(saved, account);
+			if (asi != NULL && g_hash_table_lookup(touched, account) != NULL)
+				gtk_list_store_set(GTK_LIST_STORE(model), &iter,
+						0, asi->enabled, 4, asi->enabled, -1);
+		}
+		while (gtk_tree_model_iter_next(model, &iter));
+		g_hash_table_destroy(saved);
+	}
+
+	if (touched != NULL)
+		g_hash_table_destroy(touched);
+	g_free(location_name);
+}
+
+static void
+bulk_set_all_cb(GtkMenuItem *item, gpointer data)
+{
+	LocationConfigurationDialog *dialog = (LocationConfigurationDialog *)data;
+	gchar *location_name = NULL;
+
+	if ((location_name = bulk_edit_begin(dialog)) == NULL)
+		return;
+
+	locations_model_set_all_accounts(location_name,
+			GPOINTER_TO_INT(g_object_get_data(G_OBJECT(item), "enabled")));
+
+	bulk_edit_finish(dialog, location_name, bulk_edit_accounts(location_name, NULL));
+}
+
+static void
+bulk_set_protocol_cb(GtkMenuItem *item, gpointer data)
+{
+	LocationConfigurationDialog *dialog = (LocationConfigurationDialog *)data;
+	gchar *location_name = NULL;
+	const gchar *protocol_id = NULL;
+
+	if ((location_name = bulk_edit_begin(dialog)) == NULL)
+		return;
+
+	protocol_id = (gchar *)g_object_get_data(G_OBJECT(item), "protocol");
+	locations_model_set_protocol_accounts(location_name, protocol_id,
+			GPOINTER_TO_INT(g_object_get_data(G_OBJECT(item), "enabled")));
+
+	bulk_edit_finish(dialog, location_name, bulk_edit_accounts(location_name, protocol_id));
+}
+
+static void
+bulk_copy_from_cb(GtkMenuItem *item, gpointer data)
+{
+	LocationConfigurationDialog *dialog = (LocationConfigurationDialog *)data;
+	gchar *location_name = NULL;
+	const gchar *source = NULL;
+
+	if ((location_name = bulk_edit_begin(dialog)) == NULL)
+		return;
+
+	source = (gchar *)g_object_get_data(G_OBJECT(item), "location");
+	locations_model_copy_states(location_name, source);
+
+	bulk_edit_finish(dialog, location_name, bulk_edit_accounts(source, NULL));
+}
+
+/* The states shown by the accounts view, unsaved toggles included. */
+static GList *
+bulk_view_states(LocationConfigurationDialog *dialog)
+{
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
+	GList *states = NULL;
+	PurpleAccount *account = NULL;
+	gboolean enabled = FALSE;
+
+	model = gtk_tree_view_get_model(GTK_TREE_VIEW(dialog->tvAccounts));
+	if (model == NULL || !gtk_tree_model_get_iter_first(model, &iter))
+		return NULL;
+
+	do
+	{
+		gtk_tree_model_get(model, &iter, 0, &enabled, 3, &account, -1);
+		states = g_list_prepend(states, account_state_info_new(account, enabled));
+	}
+	while (gtk_tree_model_iter_next(model, &iter));
+
+	return g_list_reverse(states);
+}
+
+/* The current location is not changed, its view keeps its unsaved toggles. */
+static void
+bulk_apply_to_cb(GtkMenuItem *item, gpointer data)
+{
+	LocationConfigurationDialog *dialog = (LocationConfigurationDialog *)data;
+	gchar *location_name = NULL;
+	GList *targets = NULL,
+		  *target = NULL,
+		  *states = NULL;
+
+	if ((location_name = bulk_edit_begin(dialog)) == NULL)
+		return;
+
+	targets = location_configure_dialog_choose_locations(dialog->dialog, location_name);
+	if (targets != NULL)
+		states = bulk_view_states(dialog);
+	for (target = targets; target != NULL; target = g_list_next(target))
+	{
+		locations_model_update_accounts((gchar *)target->data, states);
+		g_free(target->data);
+	}
+	g_list_free(targets);
+	g_list_foreach(states, (GFunc)account_state_info_free, NULL);
+	g_list_free(states);
+
+	bulk_edit_finish(dialog, location_name, NULL);
+}
+
+static void
+bulk_menu_append(GtkWidget *menu, const gchar *label, GCallback callback,
+		LocationConfigurationDialog *dialog, const gchar *key, gpointer value,
+		GDestroyNotify value_free)
+{
+	GtkWidget *item = NULL;
+
+	item = gtk_menu_item_new_with_label(label);
+	if (key != NULL)
+		g_object_set_data_full(G_OBJECT(item), key, value, value_free);
+	g_signal_connect(G_OBJECT(item), "activate", callback, dialog);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+}
+
+static GtkWidget *
+bulk_protocol_menu(LocationConfigurationDialog *dialog, GList *protocols, gboolean enabled)
+{
+	GtkWidget *menu = NULL,
+			  *item = NULL;
+	PurplePlugin *prpl = NULL;
+	GList *protocol = NULL;
+
+	menu = gtk_menu_new();
+	for (protocol = protocols; protocol != NULL; protocol = g_list_next(protocol))
+	{
+		prpl = purple_find_prpl((gchar *)protocol->data);
+		item = gtk_menu_item_new_with_label(prpl != NULL ?
+				purple_plugin_get_name(prpl) : (gchar *)protocol->data);
+		g_object_set_data_full(G_OBJECT(item), "protocol", g_strdup((gchar *)protocol->data), g_free);
+		g_object_set_data(G_OBJECT(item), "enabled", GINT_TO_POINTER(enabled));
+		g_signal_connect(G_OBJECT(item), "activate", G_CALLBACK(bulk_set_protocol_cb), dialog);
+		gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+	}
+
+	return menu;
+}
+
+static void
+bulk_clicked_handler(GtkButton *button, gpointer data)
+{
+	LocationConfigurationDialog *dialog = (LocationConfigurationDialog *)data;
+	GtkWidget *menu = NULL,
+			  *submenu = NULL,
+			  *item = NULL;
+	GHashTable *seen = NULL;
+	GList *protocols = NULL,
+		  *locations = NULL,
+		  *entry = NULL;
+	const gchar *protocol_id = NULL;
+	gchar *location_name = NULL;
+
+	location_name = location_configure_dialog_get_active_location(dialog);
+	if (location_name == NULL)
+		return;
+
+	menu = gtk_menu_new();
+	g_signal_connect(G_OBJECT(menu), "selection-done", G_CALLBACK(gtk_widget_destroy), NULL);
+
+	bulk_menu_append(menu, "Enable All", G_CALLBACK(bulk_set_all_cb), dialog,
+			"enabled", GINT_TO_POINTER(TRUE), NULL);
+	bulk_menu_append(menu, "Disable All", G_CALLBACK(bulk_set_all_cb), dialog,
+			"enabled", GINT_TO_POINTER(FALSE), NULL);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), gtk_separator_menu_item_new());
+
+	/* The distinct protocols of the location */
+	seen = g_hash_table_new(g_str_hash, g_str_equal);
+	entry = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; entry != NULL; entry = g_list_next(entry))
+	{
+		protocol_id = purple_account_get_protocol_id(((AccountStateInfo *)entry->data)->account);
+		if (g_hash_table_lookup(seen, protocol_id) == NULL)
+		{
+			g_hash_table_insert(seen, (gpointer)protocol_id, (gpointer)protocol_id);
+			protocols = g_list_prepend(protocols, (gpointer)protocol_id);
+		}
+	}
+	g_hash_table_destroy(seen);
+	protocols = g_list_sort(protocols, (GCompareFunc)g_strcmp0);
+
+	item = gtk_menu_item_new_with_label("Enable Protocol");
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), bulk_protocol_menu(dialog, protocols, TRUE));
+	gtk_widget_set_sensitive(item, protocols != NULL);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
+	item = gtk_menu_item_new_with_label("Disable Protocol");
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), bulk_protocol_menu(dialog, protocols, FALSE));
+	gtk_widget_set_sensitive(item, protocols != NULL);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+	g_list_free(protocols);
+
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), gtk_separator_menu_item_new());
+
+	submenu = gtk_menu_new();
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+	for (entry = locations; entry != NULL; entry = g_list_next(entry))
+	{
+		if (g_strcmp0((gchar *)entry->data, location_name) == 0)
+			continue;
+		bulk_menu_append(submenu, (gchar *)entry->data, G_CALLBACK(bulk_copy_from_cb), dialog,
+				"location", g_strdup((gchar *)entry->data), g_free);
+	}
+
+	item = gtk_menu_item_new_with_label("Copy From");
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), submenu);
+	gtk_widget_set_sensitive(item, g_list_length(locations) > 1);
+	gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
+	bulk_menu_append(menu, "Apply To Locations...", G_CALLBACK(bulk_apply_to_cb), dialog,
+			NULL, NULL, NULL);
+	g_list_free(locations);
+
+	gtk_widget_show_all(menu);
+	gtk_menu_popup(GTK_MENU(menu), NULL, NULL, NULL, NULL, 0, gtk_get_current_event_time());
+
+	g_free(location_name);
+}
+
+/******* end of signal handlers *******/
+
+/* The name of the location selected in the combo box, or NULL. Free it with g_free(). */
+static gchar *
+location_configure_dialog_get_active_location(LocationConfigurationDialog *dialog)
+{
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
+	gchar *location_name = NULL;
+
+	model = gtk_combo_box_get_model(GTK_COMBO_BOX(dialog->cboLocations));
+	if (gtk_combo_box_get_active_iter(GTK_COMBO_BOX(dialog->cboLocations), &iter))
+		gtk_tree_model_get(model, &iter, 0, &location_name, -1);
+
+	return location_name;
+}
+
+/*
+ * The accounts view of a location: enabled state shown, username, protocol
+ * id, the PurpleAccount and the enabled state saved in the model. The
+ * location is kept as the "location" data of the store.
+ */
+static GtkListStore *
+location_configure_dialog_accounts_store(const gchar *location_name)
+{
+	GtkListStore *store = NULL;
+
+	store = gtk_list_store_new(5, G_TYPE_BOOLEAN, G_TYPE_STRING, G_TYPE_STRING,
+			G_TYPE_POINTER, G_TYPE_BOOLEAN);
+	g_object_set_data_full(G_OBJECT(store), "location", g_strdup(location_name), g_free);
+
+	return store;
+}
+
+/*
+ * Bring the accounts view up to date with the model. The view of another
+ * location is replaced, the view of the same location is updated in place:
+ * only the rows whose saved state changed are written, so the unsaved
+ * toggles of the other rows survive, and rows of accounts the location no
+ * longer records are dropped.
+ */
+static void
+location_configure_dialog_refresh_accounts(LocationConfigurationDialog *dialog,
+		const gchar *location_name)
+{
+	GtkTreeModel *model = NULL;
+	GtkListStore *store = NULL;
+	GtkTreeIter iter;
+	GHashTable *rows = NULL;	/* PurpleAccount -> GtkTreeIter of its row */
+	GHashTableIter row;
+	GList *item = NULL;
+	AccountStateInfo *asi = NULL;
+	PurpleAccount *account = NULL;
+	GtkTreeIter *account_iter = NULL;
+	gboolean saved = FALSE;
+	gpointer value = NULL;
+
+	model = gtk_tree_view_get_model(GTK_TREE_VIEW(dialog->tvAccounts));
+	if (model != NULL && g_strcmp0(g_object_get_data(G_OBJECT(model), "location"), location_name) == 0)
+		store = GTK_LIST_STORE(model);
+	else
+		store = location_configure_dialog_accounts_store(location_name);
+
+	/* The iters of a GtkListStore stay valid while other rows change. */
+	rows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)gtk_tree_iter_free);
+	if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(store), &iter))
+	{
+		do
+		{
+			gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, 3, &account, -1);
+			g_hash_table_insert(rows, account, gtk_tree_iter_copy(&iter));
+		}
+		while (gtk_tree_model_iter_next(GTK_TREE_MODEL(store), &iter));
+	}
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		asi = (AccountStateInfo *)item->data;
+		account_iter = (GtkTreeIter *)g_hash_table_lookup(rows, asi->account);
+		if (account_iter == NULL)
+		{
+			gtk_list_store_append(store, &iter);
+			gtk_list_store_set(store, &iter,
+					0, asi->enabled,
+					1, purple_account_get_username(asi->account),
+					2, purple_account_get_protocol_id(asi->account),
+					3, asi->account,
+					4, asi->enabled,
+					-1);
+			continue;
+		}
+
+		gtk_tree_model_get(GTK_TREE_MODEL(store), account_iter, 4, &saved, -1);
+		if (saved != asi->enabled)
+			gtk_list_store_set(store, account_iter, 0, asi->enabled, 4, asi->enabled, -1);
+		g_hash_table_remove(rows, asi->account);
+	}
+
+	g_hash_table_iter_init(&row, rows);
+	while (g_hash_table_iter_next(&row, NULL, &value))
+		gtk_list_store_remove(store, (GtkTreeIter *)value);
+	g_hash_table_destroy(rows);
+
+	if (GTK_TREE_MODEL(store) != model)
+	{
+		gtk_tree_view_set_model(GTK_TREE_VIEW(dialog->tvAccounts), GTK_TREE_MODEL(store));
+		g_object_unref(store);
+	}
+}
+
+/* Write the toggled rows of the accounts view back into the model in one batch. */
+static void
+location_configure_dialog_commit_accounts(LocationConfigurationDialog *dialog,
+		const gchar *location_name)
+{
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
+	GList *states = NULL;
+	AccountStateInfo *state = NULL;
+	gboolean enabled = FALSE,
+			 saved = FALSE;
+	PurpleAccount *account = NULL;
+
+	model = gtk_tree_view_get_model(GTK_TREE_VIEW(dialog->tvAccounts));
+	if (model == NULL || !gtk_tree_model_get_iter_first(model, &iter))
+		return;
+
+	do
+	{
+		gtk_tree_model_get(model, &iter, 0, &enabled, 3, &account, 4, &saved, -1);
+		if (enabled != saved)
+			states = g_list_prepend(states, account_state_info_new(account, enabled));
+	}
+	while (gtk_tree_model_iter_next(model, &iter));
+
+	if (states == NULL)
+		return;
+	states = g_list_reverse(states);
+
+	locations_model_update_accounts(location_name, states);
+
+	for (; states != NULL; states = g_list_delete_link(states, states))
+	{
+		state = (AccountStateInfo *)states->data;
+		account_state_info_free(state);
+	}
+}
+
+/* Drop the row of a removed account, before anything reads its pointer. */
+static void
+location_configure_dialog_account_removed_cb(PurpleAccount *account, gpointer data)
+{
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
+	PurpleAccount *row_account = NULL;
+
+	model = gtk_tree_view_get_model(GTK_TREE_VIEW(configure_dialog->tvAccounts));
+	if (model == NULL || !gtk_tree_model_get_iter_first(model, &iter))
+		return;
+
+	do
+	{
+		gtk_tree_model_get(model, &iter, 3, &row_account, -1);
+		if (row_account == account)
+		{
+			gtk_list_store_remove(GTK_LIST_STORE(model), &iter);
+			return;
+		}
+	}
+	while (gtk_tree_model_iter_next(model, &iter));
+}
+
+/* Let the user pick several locations other than exclude. Returns a list of names to free. */
+static GList *
+location_configure_dialog_choose_locations(GtkWidget *parent, const gchar *exclude)
+{
+	GtkWidget *dialog = NULL,
+			  *tree = NULL,
+			  *scrolled_win = NULL;
+	GtkListStore *store = NULL;
+	GtkTreeModel *model = NULL;
+	GtkTreeSelection *selection = NULL;
+	GtkTreeIter iter;
+	GList *locations = NULL,
+		  *rows = NULL,
+		  *item = NULL,
+		  *chosen = NULL;
+	gchar *name = NULL;
+
+	dialog = gtk_dialog_new_with_buttons(
+			"Apply To Locations",
+			GTK_WINDOW(parent),
+			GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+			GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+			GTK_STOCK_APPLY, GTK_RESPONSE_OK,
+			NULL);
+	gtk_window_set_default_size(GTK_WINDOW(dialog), 250, 300);
+
+	store = gtk_list_store_new(1, G_TYPE_STRING);
+	locations = g_list_sort(locations_model_get_locations_names(), (GCompareFunc)g_utf8_collate);
+	for (item = locations; item != NULL; item = g_list_next(item))
+	{
+		if (g_strcmp0((gchar *)item->data, exclude) == 0)
+			continue;
+		gtk_list_store_append(store, &iter);
+		gtk_list_store_set(store, &iter, 0, (gchar *)item->data, -1);
+	}
+	g_list_free(locations);
+
+	tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+	g_object_unref(store);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(tree),
+			gtk_tree_view_column_new_with_attributes("Location",
+				gtk_cell_renderer_text_new(), "text", 0, NULL));
+	selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(tree));
+	gtk_tree_selection_set_mode(selection, GTK_SELECTION_MULTIPLE);
+
+	scrolled_win = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_win), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scrolled_win), tree);
+	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))),
+			scrolled_win, TRUE, TRUE, 3);
+
+	gtk_widget_show_all(dialog);
+	if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK)
+	{
+		rows = gtk_tree_selection_get_selected_rows(selection, &model);
+		for (item = rows; item != NULL; item = g_list_next(item))
+		{
+			if (gtk_tree_model_get_iter(model, &iter, (GtkTreePath *)item->data))
+			{
+				gtk_tree_model_get(model, &iter, 0, &name, -1);
+				chosen = g_list_prepend(chosen, name);
+			}
+			gtk_tree_path_free((GtkTreePath *)item->data);
+		}
+		g_list_free(rows);
+	}
+
+	gtk_widget_destroy(dialog);
+	return g_list_reverse(chosen);
+}
+
+/*
+ * Bring the dialog up to date with the model. Only the locations changed
+ * since the last sync are looked at: they are added to or removed from the
+ * locations list, and the accounts view is updated if the selected one is
+ * among them.
+ */
+static void
+location_configure_dialog_sync()
+{
+	GtkTreeModel *model = NULL;
+	GtkTreeIter iter;
+	GHashTableIter pending;
+	GList *locations = NULL,
+		  *item = NULL;
+	gpointer name = NULL;
+	gchar *active = NULL;
+	gboolean listed = FALSE,
+			 refresh = FALSE;
+
+	if (configure_dialog->sync_source != 0)
+	{
+		g_source_remove(configure_dialog->sync_source);
+		configure_dialog->sync_source = 0;
+	}
+
+	model = gtk_combo_box_get_model(GTK_COMBO_BOX(configure_dialog->cboLocations));
+	active = location_configure_dialog_get_active_location(configure_dialog);
+
+	if (configure_dialog->pending_reload)
+	{
+		gtk_list_store_clear(GTK_LIST_STORE(model));
+		locations = locations_model_get_locations_names();
+		for (item = g_list_first(locations); item != NULL; item = g_list_next(item))
+			gtk_combo_box_add_string(configure_dialog->cboLocations, (gchar *)item->data);
+		g_list_free(locations);
+
+		/* Selecting it again refreshes the accounts view. */
+		if (active != NULL)
+			gtk_combo_box_select_string(configure_dialog->cboLocations, active);
+
+		configure_dialog->pending_reload = FALSE;
+	}
+	else
+	{
+		g_hash_table_iter_init(&pending, configure_dialog->pending);
+		while (g_hash_table_iter_next(&pending, &name, NULL))
+		{
+			listed = gtk_combo_box_locate_iter(model, (gchar *)name, &iter);
+			if (!locations_model_location_exists((gchar *)name))
+			{
+				if (listed)
+					gtk_list_store_remove(GTK_LIST_STORE(model), &iter);
+			}
+			else if (!listed)
+				gtk_combo_box_add_string(configure_dialog->cboLocations, (gchar *)name);
+			else if (g_strcmp0((gchar *)name, active) == 0)
+				refresh = TRUE;
+		}
+	}
+	g_hash_table_remove_all(configure_dialog->pending);
+
+	/* Removing the active location already cleared the view. */
+	if (refresh && locations_model_location_exists(active))
+		location_configure_dialog_refresh_accounts(configure_dialog, active);
+
+	g_free(active);
+}
+
+static gboolean
+location_configure_dialog_sync_cb(gpointer data)
+{
+	configure_dialog->sync_source = 0;
+	location_configure_dialog_sync();
+
+	return FALSE;
+}
+
+/* A hidden dialog just collects the changes until it is shown again. */
+static void
+location_configure_dialog_schedule_sync(void)
+{
+	if (gtk_widget_get_visible(configure_dialog->dialog) && configure_dialog->sync_source == 0)
+		configure_dialog->sync_source = g_idle_add(location_configure_dialog_sync_cb, NULL);
+}
+
+static void
+location_configure_dialog_location_cb(const gchar *location_name, gpointer data)
+{
+	g_hash_table_insert(configure_dialog->pending, g_strdup(location_name), NULL);
+	location_configure_dialog_schedule_sync();
+}
+
+static void
+location_configure_dialog_batch_cb(GList *location_names, gpointer data)
+{
+	GList *item = NULL;
+
+	for (item = location_names; item != NULL; item = g_list_next(item))
+		g_hash_table_insert(configure_dialog->pending, g_strdup((gchar *)item->data), NULL);
+	location_configure_dialog_schedule_sync();
+}
+
+static void
+location_configure_dialog_reloaded_cb(gpointer data)
+{
+	configure_dialog->pending_reload = TRUE;
+	location_configure_dialog_schedule_sync();
+}
+
+static void
+location_configure_dialog_create()
+{
+	GtkWidget *content_area = NULL,
+			  *label = NULL,
+			  *hbox = NULL;
+	GtkWidget *scrolled_win = NULL;
+	GtkCellRenderer *renderer = NULL;
+	GtkTreeViewColumn *column = NULL;
+	GList *locations = NULL;
+	int width, height;
+
+	configure_dialog = g_new0(LocationConfigurationDialog, 1);
+	configure_dialog->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	configure_dialog->tvAccounts = gtk_tree_view_new();
 
 	renderer = gtk_cell_renderer_toggle_new();
 	g_object_set(renderer, "activatable", TRUE, NULL);
@@ -634,8 +1330,9 @@ location_configure_dialog_create()
 	gtk_container_add(GTK_CONTAINER(scrolled_win), configure_dialog->tvAccounts);
 
 	label = gtk_label_new("Location:");
-	configure_dialog->cboLocations = create_gtk_combo_box(
-			locations_model_get_locations_names());
+	locations = locations_model_get_locations_names();
+	configure_dialog->cboLocations = create_gtk_combo_box(locations);
+	g_list_free(locations);
 	hbox = gtk_hbox_new(FALSE, 4);
 	gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, TRUE, 0);
 	gtk_box_pack_start(GTK_BOX(hbox), configure_dialog->cboLocations, TRUE, TRUE, 0);
@@ -677,13 +1374,33 @@ location_configure_dialog_create()
 		   	G_CALLBACK(delete_clicked_handler), configure_dialog);
 	gtk_box_pack_start(GTK_BOX(hbox), configure_dialog->btnDelete, TRUE, TRUE, 0);
 
+	configure_dialog->btnBulk = gtk_button_new_with_mnemonic("_Bulk Edit");
+	gtk_widget_set_sensitive(configure_dialog->btnBulk, FALSE);
+	g_signal_connect(
+			G_OBJECT(configure_dialog->btnBulk), "clicked",
+		   	G_CALLBACK(bulk_clicked_handler), configure_dialog);
+	gtk_box_pack_start(GTK_BOX(hbox), configure_dialog->btnBulk, TRUE, TRUE, 0);
+
 	gtk_dialog_add_button(
 			GTK_DIALOG(configure_dialog->dialog),
 		   	GTK_STOCK_CLOSE, GTK_RESPONSE_CLOSE);
 
-	gtk_widget_show_all(configure_dialog->dialog);
-	gtk_dialog_run(GTK_DIALOG(configure_dialog->dialog));
-	gtk_widget_destroy(configure_dialog->dialog);
+	/* Show the contents now, the dialog itself is shown and hidden on each use. */
+	gtk_widget_show_all(content_area);
+	gtk_widget_show_all(hbox);
+
+	purple_signal_connect(locations_model_get_handle(), "location-added",
+			configure_dialog, PURPLE_CALLBACK(location_configure_dialog_location_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "location-changed",
+			configure_dialog, PURPLE_CALLBACK(location_configure_dialog_location_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "location-removed",
+			configure_dialog, PURPLE_CALLBACK(location_configure_dialog_location_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "locations-reloaded",
+			configure_dialog, PURPLE_CALLBACK(location_configure_dialog_reloaded_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "locations-changed",
+			configure_dialog, PURPLE_CALLBACK(location_configure_dialog_batch_cb), NULL);
+	purple_signal_connect(purple_accounts_get_handle(), "account-removed",
+			configure_dialog, PURPLE_CALLBACK(location_configure_dialog_account_removed_cb), NULL);
 }
 
 static void
@@ -691,6 +1408,11 @@ location_configure_dialog_destroy()
 {
 	if (configure_dialog != NULL)
 	{
+		purple_signals_disconnect_by_handle(configure_dialog);
+		if (configure_dialog->sync_source != 0)
+			g_source_remove(configure_dialog->sync_source);
+		g_hash_table_destroy(configure_dialog->pending);
+
 		gtk_widget_destroy(configure_dialog->dialog);
 		g_free(configure_dialog);
 		configure_dialog = NULL;
@@ -700,7 +1422,9 @@ location_configure_dialog_destroy()
 static void
 location_configure_dialog_show()
 {
+	location_configure_dialog_sync();
 	gtk_dialog_run(GTK_DIALOG(configure_dialog->dialog));
+	gtk_widget_hide(configure_dialog->dialog);
 }
 
 static void
@@ -714,9 +1438,9 @@ get_new_location_name_dialog_ok_clicked(GtkWidget *sender, gpointer data)
 	name = g_strdup(gtk_entry_get_text(GTK_ENTRY(input_dialog->name_entry)));
 	for (sp = name; *sp; ++sp)
 	{
-		if (!(*sp >= 'a' && *sp <= 'z' ||
-			*sp >= 'A' && *sp <= 'Z' ||
-			*sp >= '0' && *sp <= '9' ||
+		if (!((*sp >= 'a' && *sp <= 'z') ||
+			(*sp >= 'A' && *sp <= 'Z') ||
+			(*sp >= '0' && *sp <= '9') ||
 			*sp == '-' || *sp == '_' || *sp == ' '))
 		{
 			g_free(name);
@@ -737,13 +1461,9 @@ static gchar *
 location_configure_dialog_get_new_location_name(GtkWidget *parent)
 {
 	NewLocationNameInputDialog *input_dialog = NULL;
-	GtkWidget *dialog = NULL,
-			  *label = NULL,
-			  *name_entry = NULL,
-			  *box = NULL,
+	GtkWidget *box = NULL,
 			  *button = NULL;
-	gchar *name = NULL,
-		  *sp = NULL;
+	gchar *name = NULL;
 	GtkResponseType dialog_result = 0;
 
 	input_dialog = g_new0(NewLocationNameInputDialog, 1);
@@ -786,13 +1506,56 @@ location_configure_dialog_get_new_location_name(GtkWidget *parent)
 	return name;
 }
 
+/* The Tools menu lists the locations and marks drift, rebuild it when either changes. */
+static void
+locations_list_changed_cb(void)
+{
+	pidgin_blist_update_plugin_actions();
+}
+
+static void
+locations_switch_failed_cb(const gchar *location_name, const gchar *fallback_name)
+{
+	gchar *primary = NULL,
+		  *secondary = NULL;
+
+	primary = g_strdup_printf("Could not connect the accounts of %s.", location_name);
+	if (fallback_name != NULL)
+		secondary = g_strdup_printf("Switched to %s instead.", fallback_name);
+	else
+		secondary = g_strdup("The accounts were restored as they were before the switch.");
+
+	purple_notify_warning(locations_plugin, "Locations", primary, secondary);
+
+	g_free(primary);
+	g_free(secondary);
+}
+
 static gboolean
 plugin_load (PurplePlugin * plugin)
 {
-	purple_prefs_add_none(PREF_LOCATIONS);
-
+	locations_model_init();
 	locations_model_load();
 
+	locations_set_init();
+	locations_set_load();
+
+	locations_drift_init();
+	locations_switch_init();
+
+	locations_predict_init();
+	locations_predict_load();
+	locations_prewarm_init();
+
+	purple_signal_connect(locations_switch_get_handle(), "switch-failed",
+			plugin, PURPLE_CALLBACK(locations_switch_failed_cb), NULL);
+	purple_signal_connect(locations_drift_get_handle(), "drift-changed",
+			plugin, PURPLE_CALLBACK(locations_list_changed_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "location-added",
+			plugin, PURPLE_CALLBACK(locations_list_changed_cb), NULL);
+	purple_signal_connect(locations_model_get_handle(), "location-removed",
+			plugin, PURPLE_CALLBACK(locations_list_changed_cb), NULL);
+
 	locations_plugin = plugin;
 
 	return TRUE;
@@ -801,11 +1564,26 @@ plugin_load (PurplePlugin * plugin)
 static gboolean
 plugin_unload (PurplePlugin * plugin)
 {
-	if (locations_model != NULL)
-	{
-		locations_model_save();
-		locations_model_free();
-	}
+	location_configure_dialog_destroy();
+
+	locations_prewarm_uninit();
+	locations_predict_save();
+	locations_predict_uninit();
+
+	locations_switch_uninit();
+	locations_drift_uninit();
+
+	locations_set_save();
+	locations_set_uninit();
+
+	locations_model_save();
+	locations_model_free();
+	locations_model_uninit();
+
+	g_list_foreach(action_locations, (GFunc)g_free, NULL);
+	g_list_free(action_locations);
+	action_locations = NULL;
+
 	return TRUE;
 }
 
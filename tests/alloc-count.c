@@ -0,0 +1,86 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "alloc-count.h"
+
+/* The glibc entry points behind the interposed functions. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static gboolean counting = FALSE;
+static AllocCount count = { 0, 0 };
+
+void *
+malloc(size_t size)
+{
+	if (counting)
+	{
+		count.allocations++;
+		count.bytes += size;
+	}
+
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (counting)
+	{
+		count.allocations++;
+		count.bytes += nmemb * size;
+	}
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (counting)
+	{
+		count.allocations++;
+		count.bytes += size;
+	}
+
+	return __libc_realloc(ptr, size);
+}
+
+void
+alloc_count_begin()
+{
+	count.allocations = 0;
+	count.bytes = 0;
+	counting = TRUE;
+}
+
+AllocCount
+alloc_count_end()
+{
+	counting = FALSE;
+	return count;
+}
@@ -0,0 +1,47 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Allocation accounting for the ALLOC_ACCOUNTING=1 debug build. malloc(),
+ * calloc() and realloc() are interposed in the test binaries, so every
+ * allocation made by GLib, libpurple and the core library between
+ * alloc_count_begin() and alloc_count_end() is counted.
+ *
+ * GSlice allocations only show up when G_SLICE=always-malloc is set in the
+ * environment before the program starts, as 'make check' does.
+ */
+
+#ifndef _ALLOC_COUNT_H_
+#define _ALLOC_COUNT_H_
+
+#include <glib.h>
+
+typedef struct
+{
+	guint64 allocations;
+	guint64 bytes;
+} AllocCount;
+
+void alloc_count_begin(void);
+AllocCount alloc_count_end(void);
+
+#endif /* _ALLOC_COUNT_H_ */
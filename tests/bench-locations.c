@@ -0,0 +1,177 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * Benchmark of the model operations on a large synthetic profile. This is
+ * also the training workload of the PGO build profile.
+ *
+ * Usage: bench-locations [accounts] [locations] [iterations]
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include <account.h>
+#include <prefs.h>
+
+#include "locations-drift.h"
+#include "locations-model.h"
+#include "locations-predict.h"
+#include "locations-set.h"
+#include "locations-switch.h"
+#include "purple-fixture.h"
+
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+# include "alloc-count.h"
+#endif
+
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+# define BENCH_BEGIN(timer) G_STMT_START { alloc_count_begin(); g_timer_start(timer); } G_STMT_END
+#else
+# define BENCH_BEGIN(timer) g_timer_start(timer)
+#endif
+
+static void
+report(const gchar *operation, gint iterations, gdouble seconds)
+{
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+	AllocCount count = alloc_count_end();
+#endif
+
+	g_print("%-10s %8d iterations %10.3f ms %10.3f us/op",
+			operation, iterations, seconds * 1e3, seconds * 1e6 / iterations);
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+	g_print(" %10" G_GUINT64_FORMAT " allocs/op %10" G_GUINT64_FORMAT " bytes/op",
+			count.allocations / iterations, count.bytes / iterations);
+#endif
+	g_print("\n");
+}
+
+static void
+populate(gint accounts, gint locations)
+{
+	GList *item = NULL;
+	gchar *name = NULL;
+	gint i = 0,
+		 n = 0;
+
+	for (i = 0; i < accounts; ++i)
+	{
+		name = g_strdup_printf("bench%d@example.com", i);
+		purple_fixture_add_account(name, "prpl-jabber");
+		g_free(name);
+	}
+
+	for (i = 0; i < locations; ++i)
+	{
+		name = g_strdup_printf("Location %d", i);
+		locations_model_add_location_from_current(name);
+
+		/* Give each location a different half of the accounts. */
+		item = g_list_first(locations_model_lookup_accounts(name));
+		for (n = 0; item != NULL; item = g_list_next(item), ++n)
+			((AccountStateInfo *)item->data)->enabled = (n + i) % 2 == 0;
+
+		g_free(name);
+	}
+	locations_model_touch();
+}
+
+int
+main(int argc, char *argv[])
+{
+	gint accounts = 1000,
+		 locations = 10,
+		 iterations = 20,
+		 i = 0;
+	gchar *name = NULL;
+	GTimer *timer = NULL;
+
+	if (argc > 1) accounts = atoi(argv[1]);
+	if (argc > 2) locations = atoi(argv[2]);
+	if (argc > 3) iterations = atoi(argv[3]);
+	if (accounts <= 0 || locations <= 0 || iterations <= 0)
+	{
+		g_printerr("Usage: %s [accounts] [locations] [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	purple_fixture_init();
+	locations_model_init();
+	locations_model_load();
+	locations_set_init();
+	locations_drift_init();
+	locations_switch_init();
+	locations_predict_init();
+	populate(accounts, locations);
+
+	g_print("%d accounts, %d locations\n", accounts, locations);
+	timer = g_timer_new();
+
+	BENCH_BEGIN(timer);
+	for (i = 0; i < iterations; ++i)
+		locations_model_save();
+	report("save", iterations, g_timer_elapsed(timer, NULL));
+
+	BENCH_BEGIN(timer);
+	for (i = 0; i < iterations; ++i)
+	{
+		locations_model_free();
+		locations_model_load();
+	}
+	report("load", iterations, g_timer_elapsed(timer, NULL));
+
+	BENCH_BEGIN(timer);
+	for (i = 0; i < iterations; ++i)
+	{
+		name = g_strdup_printf("Location %d", i % locations);
+		locations_switch_to(name);
+		g_free(name);
+	}
+	report("switch", iterations, g_timer_elapsed(timer, NULL));
+
+	/* Three layers over the whole account index, as rerun on every change. */
+	locations_set_clear();
+	for (i = 0; i < MIN(locations, 3); ++i)
+	{
+		name = g_strdup_printf("Location %d", i);
+		locations_set_add_layer(name, (LocationsSetOp)i);
+		g_free(name);
+	}
+	locations_set_evaluate();
+
+	BENCH_BEGIN(timer);
+	for (i = 0; i < iterations; ++i)
+		locations_set_evaluate();
+	report("evaluate", iterations, g_timer_elapsed(timer, NULL));
+
+	g_timer_destroy(timer);
+	locations_predict_uninit();
+	locations_switch_uninit();
+	locations_drift_uninit();
+	locations_set_uninit();
+	locations_model_free();
+	purple_fixture_uninit();
+
+	return 0;
+}
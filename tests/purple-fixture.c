@@ -0,0 +1,169 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <account.h>
+#include <blist.h>
+#include <core.h>
+#include <debug.h>
+#include <eventloop.h>
+#include <util.h>
+
+#include "purple-fixture.h"
+
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+typedef struct
+{
+	PurpleInputFunction function;
+	guint result;
+	gpointer data;
+} PurpleGLibIOClosure;
+
+static gchar *fixture_user_dir = NULL;
+
+static void
+purple_glib_io_destroy(gpointer data)
+{
+	g_free(data);
+}
+
+static gboolean
+purple_glib_io_invoke(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	PurpleGLibIOClosure *closure = data;
+	PurpleInputCondition purple_cond = 0;
+
+	if (condition & PURPLE_GLIB_READ_COND)
+		purple_cond |= PURPLE_INPUT_READ;
+	if (condition & PURPLE_GLIB_WRITE_COND)
+		purple_cond |= PURPLE_INPUT_WRITE;
+
+	closure->function(closure->data, g_io_channel_unix_get_fd(source), purple_cond);
+
+	return TRUE;
+}
+
+static guint
+glib_input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function,
+		gpointer data)
+{
+	PurpleGLibIOClosure *closure = g_new0(PurpleGLibIOClosure, 1);
+	GIOChannel *channel;
+	GIOCondition cond = 0;
+
+	closure->function = function;
+	closure->data = data;
+
+	if (condition & PURPLE_INPUT_READ)
+		cond |= PURPLE_GLIB_READ_COND;
+	if (condition & PURPLE_INPUT_WRITE)
+		cond |= PURPLE_GLIB_WRITE_COND;
+
+	channel = g_io_channel_unix_new(fd);
+	closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+			purple_glib_io_invoke, closure, purple_glib_io_destroy);
+
+	g_io_channel_unref(channel);
+	return closure->result;
+}
+
+static PurpleEventLoopUiOps glib_eventloops =
+{
+	g_timeout_add,
+	g_source_remove,
+	glib_input_add,
+	g_source_remove,
+	NULL,
+	g_timeout_add_seconds,
+
+	NULL,
+	NULL,
+	NULL
+};
+
+static void
+remove_user_dir(const gchar *path)
+{
+	GDir *dir = NULL;
+	const gchar *name = NULL;
+	gchar *child = NULL;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir != NULL)
+	{
+		while ((name = g_dir_read_name(dir)) != NULL)
+		{
+			child = g_build_filename(path, name, NULL);
+			if (g_file_test(child, G_FILE_TEST_IS_DIR))
+				remove_user_dir(child);
+			else
+				g_unlink(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+	}
+
+	g_rmdir(path);
+}
+
+void
+purple_fixture_init()
+{
+	fixture_user_dir = g_build_filename(g_get_tmp_dir(), "locations-test-XXXXXX", NULL);
+	if (g_mkdtemp(fixture_user_dir) == NULL)
+		g_error("Cannot create a temporary user directory\n");
+
+	purple_util_set_user_dir(fixture_user_dir);
+	purple_debug_set_enabled(FALSE);
+	purple_eventloop_set_ui_ops(&glib_eventloops);
+
+	if (!purple_core_init(FIXTURE_UI))
+		g_error("libpurple initialization failed\n");
+
+	purple_set_blist(purple_blist_new());
+	purple_blist_load();
+}
+
+void
+purple_fixture_uninit()
+{
+	purple_core_quit();
+
+	remove_user_dir(fixture_user_dir);
+	g_free(fixture_user_dir);
+	fixture_user_dir = NULL;
+}
+
+PurpleAccount *
+purple_fixture_add_account(const gchar *username, const gchar *protocol_id)
+{
+	PurpleAccount *account = NULL;
+
+	account = purple_account_new(username, protocol_id);
+	purple_accounts_add(account);
+
+	return account;
+}
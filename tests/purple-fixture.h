@@ -0,0 +1,44 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * A headless libpurple core for the unit tests and the benchmark. The
+ * core runs on the GLib main loop with a throw-away user directory, so
+ * nothing touches the real profile.
+ */
+
+#ifndef _PURPLE_FIXTURE_H_
+#define _PURPLE_FIXTURE_H_
+
+#include <glib.h>
+
+#include <account.h>
+
+#define FIXTURE_UI "locations-test"
+
+void purple_fixture_init(void);
+void purple_fixture_uninit(void);
+
+/* Create an account and register it with the accounts subsystem. */
+PurpleAccount *purple_fixture_add_account(const gchar *username, const gchar *protocol_id);
+
+#endif /* _PURPLE_FIXTURE_H_ */
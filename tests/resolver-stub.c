@@ -0,0 +1,178 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "resolver-stub.h"
+
+typedef struct
+{
+	GResolver parent;
+} ResolverStub;
+
+typedef struct
+{
+	GResolverClass parent_class;
+} ResolverStubClass;
+
+G_DEFINE_TYPE(ResolverStub, resolver_stub, G_TYPE_RESOLVER)
+
+static GHashTable *hosts = NULL;	/* Hostname -> address string */
+static GHashTable *services = NULL;	/* Record name -> GSrvTarget */
+static guint lookups = 0;
+
+static GList *
+resolver_stub_lookup_by_name(GResolver *resolver, const gchar *hostname,
+		GCancellable *cancellable, GError **error)
+{
+	const gchar *address = NULL;
+
+	++lookups;
+	address = (const gchar *)g_hash_table_lookup(hosts, hostname);
+	if (address == NULL)
+	{
+		g_set_error(error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND,
+				"No stub address for %s", hostname);
+		return NULL;
+	}
+
+	return g_list_prepend(NULL, g_inet_address_new_from_string(address));
+}
+
+/* Answered right away, GTask still completes from the main loop. */
+static void
+resolver_stub_lookup_by_name_async(GResolver *resolver, const gchar *hostname,
+		GCancellable *cancellable, GAsyncReadyCallback callback, gpointer data)
+{
+	GTask *task = NULL;
+	GList *addresses = NULL;
+	GError *error = NULL;
+
+	task = g_task_new(resolver, cancellable, callback, data);
+	addresses = resolver_stub_lookup_by_name(resolver, hostname, cancellable, &error);
+	if (addresses != NULL)
+		g_task_return_pointer(task, addresses, (GDestroyNotify)g_resolver_free_addresses);
+	else
+		g_task_return_error(task, error);
+	g_object_unref(task);
+}
+
+static GList *
+resolver_stub_lookup_by_name_finish(GResolver *resolver, GAsyncResult *result, GError **error)
+{
+	return (GList *)g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static GList *
+resolver_stub_lookup_service(GResolver *resolver, const gchar *rrname,
+		GCancellable *cancellable, GError **error)
+{
+	GSrvTarget *target = NULL;
+
+	++lookups;
+	target = (GSrvTarget *)g_hash_table_lookup(services, rrname);
+	if (target == NULL)
+	{
+		g_set_error(error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_NOT_FOUND,
+				"No stub service %s", rrname);
+		return NULL;
+	}
+
+	return g_list_prepend(NULL, g_srv_target_copy(target));
+}
+
+static void
+resolver_stub_lookup_service_async(GResolver *resolver, const gchar *rrname,
+		GCancellable *cancellable, GAsyncReadyCallback callback, gpointer data)
+{
+	GTask *task = NULL;
+	GList *targets = NULL;
+	GError *error = NULL;
+
+	task = g_task_new(resolver, cancellable, callback, data);
+	targets = resolver_stub_lookup_service(resolver, rrname, cancellable, &error);
+	if (targets != NULL)
+		g_task_return_pointer(task, targets, (GDestroyNotify)g_resolver_free_targets);
+	else
+		g_task_return_error(task, error);
+	g_object_unref(task);
+}
+
+static GList *
+resolver_stub_lookup_service_finish(GResolver *resolver, GAsyncResult *result, GError **error)
+{
+	return (GList *)g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static void
+resolver_stub_class_init(ResolverStubClass *klass)
+{
+	GResolverClass *resolver_class = G_RESOLVER_CLASS(klass);
+
+	resolver_class->lookup_by_name = resolver_stub_lookup_by_name;
+	resolver_class->lookup_by_name_async = resolver_stub_lookup_by_name_async;
+	resolver_class->lookup_by_name_finish = resolver_stub_lookup_by_name_finish;
+	resolver_class->lookup_service = resolver_stub_lookup_service;
+	resolver_class->lookup_service_async = resolver_stub_lookup_service_async;
+	resolver_class->lookup_service_finish = resolver_stub_lookup_service_finish;
+}
+
+static void
+resolver_stub_init(ResolverStub *stub)
+{
+}
+
+void
+resolver_stub_install()
+{
+	GResolver *stub = NULL;
+
+	if (hosts == NULL)
+	{
+		hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		services = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				(GDestroyNotify)g_srv_target_free);
+	}
+
+	stub = (GResolver *)g_object_new(resolver_stub_get_type(), NULL);
+	g_resolver_set_default(stub);
+	g_object_unref(stub);
+}
+
+void
+resolver_stub_add_host(const gchar *hostname, const gchar *address)
+{
+	g_hash_table_replace(hosts, g_strdup(hostname), g_strdup(address));
+}
+
+void
+resolver_stub_add_service(const gchar *rrname, const gchar *target, guint16 port)
+{
+	g_hash_table_replace(services, g_strdup(rrname), g_srv_target_new(target, port, 0, 0));
+}
+
+guint
+resolver_stub_get_lookups()
+{
+	return lookups;
+}
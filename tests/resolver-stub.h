@@ -0,0 +1,44 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+/*
+ * A GResolver answering from a fixed table instead of DNS, for the
+ * pre-warming tests. Unknown names and services are not found.
+ */
+
+#ifndef _RESOLVER_STUB_H_
+#define _RESOLVER_STUB_H_
+
+#include <glib.h>
+
+/* Make the stub the default resolver, before locations_prewarm_init(). */
+void resolver_stub_install(void);
+
+void resolver_stub_add_host(const gchar *hostname, const gchar *address);
+
+/* rrname is the full record name, as "_xmpp-client._tcp.example.test". */
+void resolver_stub_add_service(const gchar *rrname, const gchar *target, guint16 port);
+
+/* The number of name and service lookups answered so far. */
+guint resolver_stub_get_lookups(void);
+
+#endif /* _RESOLVER_STUB_H_ */
@@ -0,0 +1,1217 @@
+/*
+ * Locations Plugin
+ *
+ * Copyright (C) 2011, Chenxiong Qi	<qcxhome@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02111-1301, USA.
+ *
+ */
+
+#include <unistd.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <account.h>
+#include <connection.h>
+#include <dnsquery.h>
+#include <prefs.h>
+#include <proxy.h>
+#include <savedstatuses.h>
+#include <signals.h>
+
+#include "locations-drift.h"
+#include "locations-model.h"
+#include "locations-predict.h"
+#include "locations-prewarm.h"
+#include "locations-set.h"
+#include "locations-switch.h"
+#include "purple-fixture.h"
+#include "resolver-stub.h"
+
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+# include "alloc-count.h"
+#endif
+
+/* Start every test from an empty model and an empty persisted map. */
+static void
+reset_model(void)
+{
+	locations_model_free();
+	purple_prefs_set_string_list(PREF_LOCATION_ACCOUNT_MAP, NULL);
+	purple_prefs_set_string_list(PREF_LOCATION_STATUS_MAP, NULL);
+	purple_prefs_set_string(PREF_LAST_LOCATION, "");
+	locations_model_load();
+}
+
+static AccountStateInfo *
+find_state(const gchar *location_name, PurpleAccount *account)
+{
+	GList *item = NULL;
+
+	item = g_list_first(locations_model_lookup_accounts(location_name));
+	for (; item != NULL; item = g_list_next(item))
+	{
+		if (((AccountStateInfo *)item->data)->account == account)
+			return (AccountStateInfo *)item->data;
+	}
+
+	return NULL;
+}
+
+static void
+test_save_load_roundtrip(void)
+{
+	PurpleAccount *home = NULL,
+				  *work = NULL;
+
+	reset_model();
+	home = purple_fixture_add_account("roundtrip-home@example.com", "prpl-jabber");
+	work = purple_fixture_add_account("roundtrip-work@example.com", "prpl-jabber");
+
+	locations_model_add_location_from_current("Home");
+	locations_model_set_account_state("Home", home, TRUE);
+	locations_model_set_account_state("Home", work, FALSE);
+	locations_model_add_location_from_current("Office");
+	locations_model_set_account_state("Office", home, FALSE);
+	locations_model_set_account_state("Office", work, TRUE);
+
+	locations_model_save();
+	locations_model_free();
+	locations_model_load();
+
+	g_assert(locations_model_location_exists("Home"));
+	g_assert(locations_model_location_exists("Office"));
+	g_assert(find_state("Home", home)->enabled);
+	g_assert(!find_state("Home", work)->enabled);
+	g_assert(!find_state("Office", home)->enabled);
+	g_assert(find_state("Office", work)->enabled);
+}
+
+static void
+test_load_skips_bad_entries(void)
+{
+	PurpleAccount *account = NULL;
+	GList *map = NULL;
+
+	reset_model();
+	account = purple_fixture_add_account("skip@example.com", "prpl-jabber");
+
+	map = g_list_append(map, "Home:skip@example.com:prpl-jabber:enabled");
+	map = g_list_append(map, "Home:missing@example.com:prpl-jabber:enabled");
+	map = g_list_append(map, "malformed entry");
+	purple_prefs_set_string_list(PREF_LOCATION_ACCOUNT_MAP, map);
+	g_list_free(map);
+
+	locations_model_free();
+	locations_model_load();
+
+	g_assert_cmpuint(g_list_length(locations_model_lookup_accounts("Home")), ==, 1);
+	g_assert(find_state("Home", account)->enabled);
+}
+
+static void
+test_switch_applies_location(void)
+{
+	PurpleAccount *on = NULL,
+				  *off = NULL;
+
+	reset_model();
+	on = purple_fixture_add_account("switch-on@example.com", "prpl-jabber");
+	off = purple_fixture_add_account("switch-off@example.com", "prpl-jabber");
+	purple_account_set_enabled(off, FIXTURE_UI, TRUE);
+
+	locations_model_add_location_from_current("Travelling");
+	locations_model_set_account_state("Travelling", on, TRUE);
+	locations_model_set_account_state("Travelling", off, FALSE);
+
+	g_assert(locations_switch_to("Travelling"));
+	g_assert(purple_account_get_enabled(on, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(off, FIXTURE_UI));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Travelling");
+
+	g_assert(!locations_switch_to("Nowhere"));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Travelling");
+}
+
+static void
+test_batched_mutations(void)
+{
+	PurpleAccount *jabber = NULL,
+				  *irc = NULL,
+				  *extra = NULL;
+	GList *states = NULL;
+	guint serial = 0;
+
+	reset_model();
+	jabber = purple_fixture_add_account("bulk@example.com", "prpl-jabber");
+	irc = purple_fixture_add_account("bulk@irc.example.com", "prpl-irc");
+
+	locations_model_add_location("Home", NULL);
+	locations_model_set_account_state("Home", jabber, FALSE);
+	locations_model_set_account_state("Home", irc, FALSE);
+
+	serial = locations_model_get_serial();
+	locations_model_set_all_accounts("Home", TRUE);
+	g_assert_cmpuint(locations_model_get_serial(), ==, serial + 1);
+	g_assert(find_state("Home", jabber)->enabled);
+	g_assert(find_state("Home", irc)->enabled);
+
+	locations_model_set_protocol_accounts("Home", "prpl-irc", FALSE);
+	g_assert(find_state("Home", jabber)->enabled);
+	g_assert(!find_state("Home", irc)->enabled);
+
+	/* Copying updates known accounts and appends the others. */
+	extra = purple_fixture_add_account("bulk-extra@example.com", "prpl-jabber");
+	locations_model_add_location("Office", NULL);
+	locations_model_set_account_state("Office", irc, TRUE);
+	locations_model_set_account_state("Office", extra, TRUE);
+	locations_model_copy_states("Home", "Office");
+	g_assert(find_state("Home", jabber)->enabled);
+	g_assert(find_state("Home", irc)->enabled);
+	g_assert(find_state("Home", extra)->enabled);
+	g_assert_cmpuint(g_list_length(locations_model_lookup_accounts("Home")), ==, 3);
+
+	states = g_list_append(states, account_state_info_new(jabber, FALSE));
+	locations_model_update_accounts("Home", states);
+	g_assert(!find_state("Home", jabber)->enabled);
+	g_assert_cmpuint(g_list_length(locations_model_lookup_accounts("Home")), ==, 3);
+	account_state_info_free((AccountStateInfo *)states->data);
+	g_list_free(states);
+}
+
+typedef struct
+{
+	gint added;
+	gint changed;
+	gint removed;
+	gint reloaded;
+	gint batches;
+	guint batched;
+} Notifications;
+
+static void
+location_added_cb(const gchar *location_name, Notifications *n)
+{
+	n->added++;
+}
+
+static void
+location_changed_cb(const gchar *location_name, Notifications *n)
+{
+	n->changed++;
+}
+
+static void
+location_removed_cb(const gchar *location_name, Notifications *n)
+{
+	g_assert(!locations_model_location_exists(location_name));
+	n->removed++;
+}
+
+static void
+locations_reloaded_cb(Notifications *n)
+{
+	n->reloaded++;
+}
+
+static void
+locations_changed_cb(GList *location_names, Notifications *n)
+{
+	n->batches++;
+	n->batched += g_list_length(location_names);
+}
+
+static void
+test_change_notifications(void)
+{
+	Notifications n = { 0, 0, 0, 0, 0, 0 };
+	PurpleAccount *account = NULL;
+	void *model_handle = locations_model_get_handle();
+
+	reset_model();
+	account = purple_fixture_add_account("notify@example.com", "prpl-jabber");
+
+	purple_signal_connect(model_handle, "location-added", &n,
+			PURPLE_CALLBACK(location_added_cb), &n);
+	purple_signal_connect(model_handle, "location-changed", &n,
+			PURPLE_CALLBACK(location_changed_cb), &n);
+	purple_signal_connect(model_handle, "location-removed", &n,
+			PURPLE_CALLBACK(location_removed_cb), &n);
+	purple_signal_connect(model_handle, "locations-reloaded", &n,
+			PURPLE_CALLBACK(locations_reloaded_cb), &n);
+	purple_signal_connect(model_handle, "locations-changed", &n,
+			PURPLE_CALLBACK(locations_changed_cb), &n);
+
+	locations_model_add_location_from_current("Home");
+	g_assert_cmpint(n.added, ==, 1);
+
+	locations_model_set_account_state("Home", account, TRUE);
+	locations_model_set_all_accounts("Home", FALSE);
+	g_assert_cmpint(n.changed, ==, 2);
+
+	/* A batch reports every location it changed once, in one notification. */
+	locations_model_add_location_from_current("Work");
+	locations_model_add_location_from_current("Travel");
+	locations_model_begin_batch();
+	locations_model_copy_states("Work", "Home");
+	locations_model_copy_states("Travel", "Home");
+	locations_model_set_all_accounts("Work", TRUE);
+	g_assert_cmpint(n.batches, ==, 0);
+	locations_model_end_batch();
+	g_assert_cmpint(n.changed, ==, 2);
+	g_assert_cmpint(n.batches, ==, 1);
+	g_assert_cmpuint(n.batched, ==, 2);
+	g_assert(locations_model_delete_location("Work"));
+	g_assert(locations_model_delete_location("Travel"));
+
+	locations_model_save();
+	locations_model_free();
+	locations_model_load();
+	g_assert_cmpint(n.reloaded, ==, 1);
+
+	g_assert(locations_model_delete_location("Home"));
+	g_assert(!locations_model_delete_location("Home"));
+	g_assert_cmpint(n.removed, ==, 3);
+	g_assert_cmpint(n.added, ==, 3);
+
+	purple_signals_disconnect_by_handle(&n);
+}
+
+/* 70 accounts, so the bitmaps span more than one word. */
+#define SET_ACCOUNTS 70
+
+static PurpleAccount *set_accounts[SET_ACCOUNTS];
+
+/* A location recording accounts [first, last), enabling those with the given parity. */
+static void
+add_set_location(const gchar *name, gint first, gint last, gint parity)
+{
+	GList *asis = NULL;
+	gchar *username = NULL;
+	gint i = 0;
+
+	for (i = first; i < last; ++i)
+	{
+		if (set_accounts[i] == NULL)
+		{
+			username = g_strdup_printf("set%d@example.com", i);
+			set_accounts[i] = purple_fixture_add_account(username, "prpl-jabber");
+			g_free(username);
+		}
+		asis = g_list_append(asis, account_state_info_new(set_accounts[i], i % 2 == parity));
+	}
+
+	locations_model_add_location(name, asis);
+}
+
+static void
+expect_state_cb(PurpleAccount *account, gboolean enabled, gpointer data)
+{
+	GHashTable *states = (GHashTable *)data;
+
+	g_hash_table_insert(states, account, GINT_TO_POINTER(enabled ? 1 : 2));
+}
+
+/* 0 if the set does not record the account, 1 if enabled, 2 if disabled */
+static gint
+evaluated_state(GHashTable *states, gint i)
+{
+	return GPOINTER_TO_INT(g_hash_table_lookup(states, set_accounts[i]));
+}
+
+static GHashTable *
+evaluate_set(void)
+{
+	GHashTable *states = NULL;
+
+	g_assert(locations_set_evaluate());
+	states = g_hash_table_new(g_direct_hash, g_direct_equal);
+	locations_set_foreach_account(expect_state_cb, states);
+
+	return states;
+}
+
+static void
+test_set_union_intersect_override(void)
+{
+	GHashTable *states = NULL;
+
+	reset_model();
+	/* Even accounts of 0..39 enabled, odd accounts of 30..69 enabled */
+	add_set_location("Office", 0, 40, 0);
+	add_set_location("Travelling", 30, 70, 1);
+
+	locations_set_clear();
+	locations_set_add_layer("Office", LOCATIONS_SET_UNION);
+	locations_set_add_layer("Travelling", LOCATIONS_SET_UNION);
+	states = evaluate_set();
+	g_assert_cmpint(evaluated_state(states, 2), ==, 1);
+	g_assert_cmpint(evaluated_state(states, 3), ==, 2);
+	g_assert_cmpint(evaluated_state(states, 32), ==, 1);
+	g_assert_cmpint(evaluated_state(states, 33), ==, 1);
+	g_assert_cmpint(evaluated_state(states, 65), ==, 1);
+	g_assert_cmpint(evaluated_state(states, 66), ==, 2);
+	g_hash_table_destroy(states);
+
+	locations_set_add_layer("Travelling", LOCATIONS_SET_INTERSECT);
+	states = evaluate_set();
+	g_assert_cmpint(evaluated_state(states, 2), ==, 1);
+	g_assert_cmpint(evaluated_state(states, 32), ==, 2);
+	g_assert_cmpint(evaluated_state(states, 33), ==, 2);
+	/* Office does not record it, Travelling alone decides. */
+	g_assert_cmpint(evaluated_state(states, 65), ==, 1);
+	g_hash_table_destroy(states);
+
+	locations_set_add_layer("Travelling", LOCATIONS_SET_OVERRIDE);
+	states = evaluate_set();
+	g_assert_cmpint(evaluated_state(states, 2), ==, 1);
+	g_assert_cmpint(evaluated_state(states, 32), ==, 2);
+	g_assert_cmpint(evaluated_state(states, 33), ==, 1);
+	g_hash_table_destroy(states);
+
+	locations_set_clear();
+}
+
+static void
+test_set_switch_and_persist(void)
+{
+	reset_model();
+	add_set_location("Office", 0, 40, 0);
+	add_set_location("Do-not-disturb", 0, 70, 2);
+
+	locations_set_clear();
+	locations_set_add_layer("Office", LOCATIONS_SET_UNION);
+	locations_set_add_layer("Do-not-disturb", LOCATIONS_SET_OVERRIDE);
+	g_assert(locations_switch_to_set());
+	g_assert(!purple_account_get_enabled(set_accounts[2], FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(set_accounts[69], FIXTURE_UI));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Office");
+
+	locations_set_load();
+	g_assert_cmpuint(g_list_length(locations_set_get_layers()), ==, 2);
+	g_assert(((LocationsSetLayer *)g_list_last(locations_set_get_layers())->data)->op
+			== LOCATIONS_SET_OVERRIDE);
+
+	/* An empty set stays empty, the last location is only taken over once. */
+	locations_set_clear();
+	locations_set_save();
+	locations_set_load();
+	g_assert(locations_set_get_layers() == NULL);
+
+	/* Deleting the base location leaves the layer above as the base. */
+	locations_set_add_layer("Office", LOCATIONS_SET_UNION);
+	locations_set_add_layer("Do-not-disturb", LOCATIONS_SET_UNION);
+	locations_model_delete_location("Office");
+	g_assert_cmpuint(g_list_length(locations_set_get_layers()), ==, 1);
+	g_assert(((LocationsSetLayer *)locations_set_get_layers()->data)->op
+			== LOCATIONS_SET_OVERRIDE);
+	g_assert(locations_switch_to_set());
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Do-not-disturb");
+	locations_set_load();
+	g_assert_cmpuint(g_list_length(locations_set_get_layers()), ==, 1);
+
+	/* A set referring to a missing location is refused. */
+	locations_set_add_layer("Office", LOCATIONS_SET_UNION);
+	g_assert(!locations_switch_to_set());
+
+	locations_set_clear();
+}
+
+static void
+test_drift_tracking(void)
+{
+	PurpleAccount *chat = NULL,
+				  *mail = NULL;
+	GList *accounts = NULL;
+
+	reset_model();
+	chat = purple_fixture_add_account("drift-chat@example.com", "prpl-jabber");
+	mail = purple_fixture_add_account("drift-mail@example.com", "prpl-jabber");
+
+	locations_model_add_location_from_current("Cafe");
+	locations_model_set_account_state("Cafe", chat, TRUE);
+	locations_model_set_account_state("Cafe", mail, FALSE);
+
+	/* The switch's own changes are not drift. */
+	g_assert(locations_switch_to("Cafe"));
+	g_assert_cmpuint(locations_drift_get_count(), ==, 0);
+
+	purple_account_set_enabled(mail, FIXTURE_UI, TRUE);
+	g_assert_cmpuint(locations_drift_get_count(), ==, 1);
+	accounts = locations_drift_get_accounts();
+	g_assert(accounts != NULL && accounts->data == mail);
+	g_list_free(accounts);
+
+	/* Toggling back by hand is no drift either. */
+	purple_account_set_enabled(mail, FIXTURE_UI, FALSE);
+	g_assert_cmpuint(locations_drift_get_count(), ==, 0);
+
+	purple_account_set_enabled(chat, FIXTURE_UI, FALSE);
+	purple_account_set_enabled(mail, FIXTURE_UI, TRUE);
+	g_assert_cmpuint(locations_drift_get_count(), ==, 2);
+
+	/* Re-applying touches the drifted accounts only. */
+	locations_drift_reapply();
+	g_assert_cmpuint(locations_drift_get_count(), ==, 0);
+	g_assert(purple_account_get_enabled(chat, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(mail, FIXTURE_UI));
+
+	/* Saving the drift makes it the location's state. */
+	purple_account_set_enabled(mail, FIXTURE_UI, TRUE);
+	locations_drift_save();
+	g_assert_cmpuint(locations_drift_get_count(), ==, 0);
+	g_assert(find_state("Cafe", mail)->enabled);
+	g_assert(find_state("Cafe", chat)->enabled);
+
+	locations_set_clear();
+}
+
+/* A union layer cannot disable, an intersect layer cannot enable. */
+static void
+test_drift_save_combined_set(void)
+{
+	PurpleAccount *laptop = NULL,
+				  *phone = NULL;
+
+	reset_model();
+	laptop = purple_fixture_add_account("combined-laptop@example.com", "prpl-jabber");
+	phone = purple_fixture_add_account("combined-phone@example.com", "prpl-jabber");
+
+	locations_model_add_location("Base", NULL);
+	locations_model_set_account_state("Base", laptop, TRUE);
+	locations_model_set_account_state("Base", phone, FALSE);
+	locations_model_add_location("Extra", NULL);
+	locations_model_set_account_state("Extra", laptop, FALSE);
+	locations_model_add_location("Quiet", NULL);
+	locations_model_set_account_state("Quiet", phone, TRUE);
+
+	locations_set_clear();
+	locations_set_add_layer("Base", LOCATIONS_SET_OVERRIDE);
+	locations_set_add_layer("Extra", LOCATIONS_SET_UNION);
+	locations_set_add_layer("Quiet", LOCATIONS_SET_INTERSECT);
+	g_assert(locations_switch_to_set());
+	g_assert(purple_account_get_enabled(laptop, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(phone, FIXTURE_UI));
+
+	purple_account_set_enabled(laptop, FIXTURE_UI, FALSE);
+	purple_account_set_enabled(phone, FIXTURE_UI, TRUE);
+	g_assert_cmpuint(locations_drift_get_count(), ==, 2);
+
+	/* Only the base can bring both to the live state. */
+	locations_drift_save();
+	g_assert_cmpuint(locations_drift_get_count(), ==, 0);
+	g_assert(!find_state("Base", laptop)->enabled);
+	g_assert(find_state("Base", phone)->enabled);
+	g_assert(!find_state("Extra", laptop)->enabled);
+	g_assert(find_state("Quiet", phone)->enabled);
+
+	purple_account_set_enabled(phone, FIXTURE_UI, FALSE);
+	locations_set_clear();
+}
+
+static void
+test_predict_next(void)
+{
+	gint i = 0;
+
+	reset_model();
+	purple_prefs_set_string_list(PREF_HISTORY, NULL);
+	locations_predict_load();
+	locations_model_add_location_from_current("Home");
+	locations_model_add_location_from_current("Work");
+	locations_model_add_location_from_current("Gym");
+
+	g_assert(locations_predict_next("Home", 9) == NULL);
+
+	for (i = 0; i < 3; ++i)
+	{
+		locations_predict_record("Home", "Work", 9);
+		locations_predict_record("Work", "Home", 18);
+	}
+	locations_predict_record("Work", "Gym", 18);
+
+	g_assert_cmpstr(locations_predict_next("Home", 9), ==, "Work");
+	g_assert_cmpstr(locations_predict_next("Work", 18), ==, "Home");
+	/* Without switches at that hour the transitions decide alone. */
+	g_assert_cmpstr(locations_predict_next("Work", 7), ==, "Home");
+
+	locations_predict_load();
+	g_assert_cmpstr(locations_predict_next("Work", 18), ==, "Home");
+
+	locations_model_delete_location("Home");
+	g_assert_cmpstr(locations_predict_next("Work", 18), ==, "Gym");
+}
+
+static void
+prewarm_wait(void)
+{
+	while (locations_prewarm_get_pending() > 0)
+		g_main_context_iteration(NULL, TRUE);
+}
+
+static void
+test_prewarm_cache_bounds(void)
+{
+	/* Address literals resolve without a DNS server. */
+	purple_prefs_set_int(PREF_PREWARM_CACHE_SIZE, 2);
+	locations_prewarm_host("127.0.0.1");
+	locations_prewarm_host("127.0.0.2");
+	locations_prewarm_host("127.0.0.3");
+	prewarm_wait();
+
+	g_assert_cmpuint(locations_prewarm_get_cache_size(), ==, 2);
+	g_assert(!locations_prewarm_is_cached("127.0.0.1"));
+	g_assert(locations_prewarm_is_cached("127.0.0.3"));
+
+	/* The least recently used entry goes first. */
+	g_assert(locations_prewarm_is_cached("127.0.0.2"));
+	locations_prewarm_host("127.0.0.4");
+	prewarm_wait();
+
+	g_assert_cmpuint(locations_prewarm_get_cache_size(), ==, 2);
+	g_assert(locations_prewarm_is_cached("127.0.0.2"));
+	g_assert(locations_prewarm_is_cached("127.0.0.4"));
+	g_assert(!locations_prewarm_is_cached("127.0.0.3"));
+}
+
+static void
+test_prewarm_skips_proxied_accounts(void)
+{
+	PurpleAccount *direct = NULL,
+				  *proxied = NULL;
+	PurpleProxyInfo *proxy = NULL;
+
+	reset_model();
+	purple_prefs_set_int(PREF_PREWARM_CACHE_SIZE, 32);
+	direct = purple_fixture_add_account("direct@irc.example.test", "prpl-irc");
+	purple_account_set_string(direct, "server", "127.0.1.1");
+	proxied = purple_fixture_add_account("proxied@irc.example.test", "prpl-irc");
+	purple_account_set_string(proxied, "server", "127.0.1.2");
+	proxy = purple_proxy_info_new();
+	purple_proxy_info_set_type(proxy, PURPLE_PROXY_SOCKS5);
+	purple_account_set_proxy_info(proxied, proxy);
+
+	locations_model_add_location("Remote", NULL);
+	locations_model_set_account_state("Remote", direct, TRUE);
+	locations_model_set_account_state("Remote", proxied, TRUE);
+	locations_prewarm_location("Remote");
+	prewarm_wait();
+
+	/* The proxy resolves the names of its accounts, they never leak here. */
+	g_assert(locations_prewarm_is_cached("127.0.1.1"));
+	g_assert(!locations_prewarm_is_cached("127.0.1.2"));
+}
+
+static void
+proxy_connected_cb(gpointer data, gint source, const gchar *error_message)
+{
+	*(gint *)data = source;
+}
+
+/* Connect the way the protocols do, libpurple asks the DNS query UI first. */
+static gint
+prewarm_connect(const gchar *host, guint16 port)
+{
+	gint source = G_MININT;
+
+	g_assert(purple_proxy_connect(&source, NULL, host, port, proxy_connected_cb, &source) != NULL);
+	while (source == G_MININT)
+		g_main_context_iteration(NULL, TRUE);
+
+	if (source >= 0)
+		close(source);
+	return source;
+}
+
+static void
+test_prewarm_resolve_host(void)
+{
+	GSocketListener *listener = NULL;
+	GSocketAddress *address = NULL,
+				   *bound = NULL;
+	PurpleAccount *account = NULL;
+	PurpleConnection *gc = NULL;
+	guint16 port = 0;
+	guint lookups = 0;
+
+	reset_model();
+	purple_prefs_set_int(PREF_PREWARM_CACHE_SIZE, 32);
+
+	/* A server on the loopback, named by the SRV record of the JID's domain */
+	listener = g_socket_listener_new();
+	address = g_inet_socket_address_new_from_string("127.0.0.1", 0);
+	g_assert(g_socket_listener_add_address(listener, address, G_SOCKET_TYPE_STREAM,
+				G_SOCKET_PROTOCOL_TCP, NULL, &bound, NULL));
+	port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(bound));
+	resolver_stub_add_host("xmpp.example.test", "127.0.0.1");
+	resolver_stub_add_host("example.test", "127.0.0.1");
+	resolver_stub_add_service("_xmpp-client._tcp.example.test", "xmpp.example.test", port);
+
+	account = purple_fixture_add_account("user@example.test", "prpl-jabber");
+	locations_model_add_location("Remote", NULL);
+	locations_model_set_account_state("Remote", account, TRUE);
+	locations_prewarm_location("Remote");
+	prewarm_wait();
+	g_assert(locations_prewarm_is_cached("xmpp.example.test"));
+	g_assert(locations_prewarm_is_cached("example.test"));
+
+	/* The cache answers libpurple's query, the resolver is not asked again. */
+	lookups = resolver_stub_get_lookups();
+	g_assert_cmpint(prewarm_connect("xmpp.example.test", port), >=, 0);
+	g_assert_cmpuint(resolver_stub_get_lookups(), ==, lookups);
+
+	/* Once the cached address fails the account, its servers are forgotten. */
+	g_socket_listener_close(listener);
+	g_assert_cmpint(prewarm_connect("xmpp.example.test", port), <, 0);
+	gc = g_new0(PurpleConnection, 1);
+	gc->account = account;
+	purple_signal_emit(purple_connections_get_handle(), "connection-error", gc,
+			PURPLE_CONNECTION_ERROR_NETWORK_ERROR, "Connection refused");
+	g_free(gc);
+	g_assert(!locations_prewarm_is_cached("xmpp.example.test"));
+	g_assert(!locations_prewarm_is_cached("example.test"));
+
+	g_object_unref(bound);
+	g_object_unref(address);
+	g_object_unref(listener);
+}
+
+static void
+dns_resolved_cb(GSList *hosts, gpointer data, const char *error_message)
+{
+	gint *addresses = (gint *)data;
+
+	/* Pairs of address length and struct sockaddr */
+	*addresses = g_slist_length(hosts) / 2;
+	while (hosts != NULL)
+	{
+		hosts = g_slist_delete_link(hosts, hosts);
+		g_free(hosts->data);
+		hosts = g_slist_delete_link(hosts, hosts);
+	}
+}
+
+static void
+test_prewarm_fallback(void)
+{
+	gint addresses = -1;
+	guint lookups = 0;
+
+	/* A name the cache does not hold is left to libpurple's own resolver. */
+	lookups = resolver_stub_get_lookups();
+	g_assert(!locations_prewarm_is_cached("localhost"));
+	g_assert(purple_dnsquery_a("localhost", 5222, dns_resolved_cb, &addresses) != NULL);
+	while (addresses < 0)
+		g_main_context_iteration(NULL, TRUE);
+
+	g_assert_cmpint(addresses, >, 0);
+	g_assert(!locations_prewarm_is_cached("localhost"));
+	g_assert_cmpuint(resolver_stub_get_lookups(), ==, lookups);
+}
+
+static void
+test_location_status(void)
+{
+	PurpleSavedStatus *away = NULL;
+	PurpleAccount *account = NULL;
+
+	reset_model();
+	account = purple_fixture_add_account("status@example.com", "prpl-jabber");
+	away = purple_savedstatus_new("Out of office", PURPLE_STATUS_AWAY);
+
+	locations_model_add_location_from_current("Meeting");
+	locations_model_set_account_state("Meeting", account, TRUE);
+	g_assert(locations_model_get_status("Meeting") == 0);
+
+	locations_model_set_status("Meeting", purple_savedstatus_get_creation_time(away));
+	locations_model_save();
+	locations_model_free();
+	locations_model_load();
+	g_assert(locations_model_get_status("Meeting") == purple_savedstatus_get_creation_time(away));
+
+	/* The switch makes the location's status the current one. */
+	g_assert(locations_switch_to("Meeting"));
+	g_assert(purple_savedstatus_get_current() == away);
+	g_assert(purple_account_get_enabled(account, FIXTURE_UI));
+
+	locations_model_set_status("Meeting", 0);
+	g_assert(locations_model_get_status("Meeting") == 0);
+
+	locations_model_set_status("Meeting", purple_savedstatus_get_creation_time(away));
+	locations_model_delete_location("Meeting");
+	locations_model_add_location_from_current("Meeting");
+	g_assert(locations_model_get_status("Meeting") == 0);
+
+	locations_set_clear();
+}
+
+static gboolean switch_failed = FALSE;
+static gchar *switch_fallback = NULL;
+
+static void
+switch_failed_cb(const gchar *location_name, const gchar *fallback_name, gpointer data)
+{
+	switch_failed = TRUE;
+	g_free(switch_fallback);
+	switch_fallback = g_strdup(fallback_name);
+}
+
+static void
+wait_for_switch(void)
+{
+	while (locations_switch_in_transaction())
+		g_main_context_iteration(NULL, TRUE);
+}
+
+/* The fixture loads no protocol plugins, enabled accounts never sign on. */
+static void
+test_switch_transaction(void)
+{
+	PurpleAccount *lan = NULL,
+				  *vpn = NULL;
+
+	reset_model();
+	lan = purple_fixture_add_account("transaction-lan@example.com", "prpl-jabber");
+	vpn = purple_fixture_add_account("transaction-vpn@example.com", "prpl-jabber");
+	purple_account_set_enabled(lan, FIXTURE_UI, TRUE);
+
+	locations_model_add_location_from_current("Cafe");
+	locations_model_add_location_from_current("Corporate");
+	locations_model_set_account_state("Corporate", lan, FALSE);
+	locations_model_set_account_state("Corporate", vpn, TRUE);
+	g_assert(locations_switch_to("Cafe"));
+
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE, 1);
+	purple_signal_connect(locations_switch_get_handle(), "switch-failed",
+			&switch_failed, PURPLE_CALLBACK(switch_failed_cb), NULL);
+
+	/* Without a fallback location the previous state comes back. */
+	g_assert(locations_switch_to("Corporate"));
+	g_assert(locations_switch_in_transaction());
+	g_assert(purple_account_get_enabled(vpn, FIXTURE_UI));
+	wait_for_switch();
+
+	g_assert(switch_failed);
+	g_assert(switch_fallback == NULL);
+	g_assert(purple_account_get_enabled(lan, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(vpn, FIXTURE_UI));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Cafe");
+
+	/* With one the switch ends there. */
+	locations_model_add_location_from_current("Offline");
+	locations_model_set_account_state("Offline", lan, FALSE);
+	purple_prefs_set_string(PREF_FALLBACK_LOCATION, "Offline");
+	switch_failed = FALSE;
+
+	g_assert(locations_switch_to("Corporate"));
+	wait_for_switch();
+
+	g_assert(switch_failed);
+	g_assert_cmpstr(switch_fallback, ==, "Offline");
+	g_assert(!purple_account_get_enabled(lan, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(vpn, FIXTURE_UI));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Offline");
+
+	purple_signals_disconnect_by_handle(&switch_failed);
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE, 0);
+	purple_prefs_set_string(PREF_FALLBACK_LOCATION, "");
+	g_free(switch_fallback);
+	switch_fallback = NULL;
+	locations_set_clear();
+}
+
+/* A protocol failing from within login, before purple_account_set_enabled() returns */
+static void
+login_error_cb(PurpleAccount *account, gpointer data)
+{
+	PurpleConnection *gc = NULL;
+
+	gc = g_new0(PurpleConnection, 1);
+	gc->account = account;
+	purple_signal_emit(purple_connections_get_handle(), "connection-error", gc,
+			PURPLE_CONNECTION_ERROR_INVALID_USERNAME, "Invalid JID");
+	g_free(gc);
+}
+
+static void
+test_switch_error_during_login(void)
+{
+	PurpleAccount *invalid = NULL;
+	gint64 started = 0;
+
+	reset_model();
+	invalid = purple_fixture_add_account("invalid@", "prpl-jabber");
+	locations_model_add_location("Invalid", NULL);
+	locations_model_set_account_state("Invalid", invalid, TRUE);
+
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE, 60);
+	purple_signal_connect(purple_accounts_get_handle(), "account-enabled",
+			&started, PURPLE_CALLBACK(login_error_cb), NULL);
+
+	/* The switch fails right away instead of waiting out the deadline. */
+	started = g_get_monotonic_time();
+	g_assert(locations_switch_to("Invalid"));
+	wait_for_switch();
+	g_assert_cmpint(g_get_monotonic_time() - started, <, 10 * G_USEC_PER_SEC);
+	g_assert(!purple_account_get_enabled(invalid, FIXTURE_UI));
+
+	purple_signals_disconnect_by_handle(&started);
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE, 0);
+	locations_set_clear();
+}
+
+static void
+test_switch_fallback_restores(void)
+{
+	PurpleAccount *lan = NULL,
+				  *vpn = NULL,
+				  *mobile = NULL;
+
+	reset_model();
+	purple_prefs_set_string_list(PREF_HISTORY, NULL);
+	locations_predict_load();
+	lan = purple_fixture_add_account("fallback-lan@example.com", "prpl-jabber");
+	vpn = purple_fixture_add_account("fallback-vpn@example.com", "prpl-jabber");
+	mobile = purple_fixture_add_account("fallback-mobile@example.com", "prpl-jabber");
+	purple_account_set_enabled(lan, FIXTURE_UI, TRUE);
+
+	locations_model_add_location("Desk", NULL);
+	locations_model_set_account_state("Desk", lan, TRUE);
+	locations_model_add_location("Corporate", NULL);
+	locations_model_set_account_state("Corporate", lan, FALSE);
+	locations_model_set_account_state("Corporate", vpn, TRUE);
+	/* The fallback knows neither account of the failing switch */
+	locations_model_add_location("Tethered", NULL);
+	locations_model_set_account_state("Tethered", mobile, TRUE);
+	g_assert(locations_switch_to("Desk"));
+
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE, 1);
+	purple_prefs_set_string(PREF_FALLBACK_LOCATION, "Tethered");
+	purple_signal_connect(locations_switch_get_handle(), "switch-failed",
+			&switch_failed, PURPLE_CALLBACK(switch_failed_cb), NULL);
+	switch_failed = FALSE;
+
+	g_assert(locations_switch_to("Corporate"));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Desk");
+	while (!switch_failed)
+		g_main_context_iteration(NULL, TRUE);
+
+	/* The account that never signed on does not stay enabled. */
+	g_assert_cmpstr(switch_fallback, ==, "Tethered");
+	g_assert(locations_switch_in_transaction());
+	g_assert(!purple_account_get_enabled(vpn, FIXTURE_UI));
+	g_assert(purple_account_get_enabled(mobile, FIXTURE_UI));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Desk");
+
+	/* Rolling the fallback back restores the account only it enabled. */
+	wait_for_switch();
+	g_assert(switch_fallback == NULL);
+	g_assert(purple_account_get_enabled(lan, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(vpn, FIXTURE_UI));
+	g_assert(!purple_account_get_enabled(mobile, FIXTURE_UI));
+	g_assert_cmpstr(locations_switch_get_last_location(), ==, "Desk");
+	g_assert(locations_predict_next("Desk", locations_predict_current_hour()) == NULL);
+
+	purple_signals_disconnect_by_handle(&switch_failed);
+	purple_prefs_set_int(PREF_CONNECT_DEADLINE, 0);
+	purple_prefs_set_string(PREF_FALLBACK_LOCATION, "");
+	g_free(switch_fallback);
+	switch_fallback = NULL;
+	purple_account_set_enabled(lan, FIXTURE_UI, FALSE);
+	locations_set_clear();
+}
+
+static void
+test_account_removed(void)
+{
+	Notifications n = { 0, 0, 0, 0, 0, 0 };
+	PurpleAccount *kept = NULL,
+				  *removed = NULL;
+
+	reset_model();
+	kept = purple_fixture_add_account("kept@example.com", "prpl-jabber");
+	removed = purple_fixture_add_account("removed@example.com", "prpl-jabber");
+	locations_model_add_location("Home", NULL);
+	locations_model_set_account_state("Home", kept, TRUE);
+	locations_model_set_account_state("Home", removed, TRUE);
+	locations_model_add_location("Work", NULL);
+	locations_model_set_account_state("Work", removed, FALSE);
+	locations_model_add_location("Away", NULL);
+	locations_model_set_account_state("Away", kept, FALSE);
+
+	purple_signal_connect(locations_model_get_handle(), "location-changed", &n,
+			PURPLE_CALLBACK(location_changed_cb), &n);
+	purple_signal_connect(locations_model_get_handle(), "locations-changed", &n,
+			PURPLE_CALLBACK(locations_changed_cb), &n);
+
+	purple_accounts_remove(removed);
+	g_assert(find_state("Home", removed) == NULL);
+	g_assert(find_state("Home", kept) != NULL);
+	g_assert(find_state("Work", removed) == NULL);
+	g_assert(locations_model_location_exists("Work"));
+	g_assert(find_state("Away", kept) != NULL);
+
+	/* Both locations holding the account are notified together. */
+	g_assert_cmpint(n.changed, ==, 0);
+	g_assert_cmpint(n.batches, ==, 1);
+	g_assert_cmpuint(n.batched, ==, 2);
+
+	purple_signals_disconnect_by_handle(&n);
+	purple_account_destroy(removed);
+}
+
+static void
+test_delete_location(void)
+{
+	reset_model();
+	purple_fixture_add_account("delete@example.com", "prpl-jabber");
+
+	locations_model_add_location_from_current("Home");
+	g_assert(locations_model_delete_location("Home"));
+	g_assert(!locations_model_location_exists("Home"));
+	g_assert(!locations_model_delete_location("Home"));
+}
+
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+
+/*
+ * Allocation budgets of the model operations. Each operation is measured on
+ * a small and a large location: the difference gives the cost per entry and
+ * the intercept the fixed cost, such as creating the hash tables or saving
+ * the prefs that do not grow with the location. Both are compared without
+ * rounding. The budgets are estimates counted from the code paths of the
+ * core library and libpurple 2.x, plus a margin below one allocation per
+ * entry, so any new allocation per entry fails. They have not been
+ * measured yet: replace them with the figures 'make check-alloc' prints,
+ * plus the same margin. Raise a budget only together with the change that
+ * needs the allocations.
+ */
+#define BUDGET_SMALL 50
+#define BUDGET_LARGE 250
+
+typedef struct
+{
+	const gchar *operation;
+	void (*prepare)(gint entries);
+	void (*run)(void);
+	gdouble allocations;
+	gdouble bytes;
+	gdouble fixed_allocations;
+	gdouble fixed_bytes;
+} AllocBudget;
+
+static PurpleAccount *budget_accounts[BUDGET_LARGE];
+
+static GList *
+budget_location(gint entries, gboolean enabled)
+{
+	GList *asis = NULL;
+	gchar *username = NULL;
+	gint i = 0;
+
+	for (i = 0; i < entries; ++i)
+	{
+		if (budget_accounts[i] == NULL)
+		{
+			username = g_strdup_printf("budget%d@example.com", i);
+			budget_accounts[i] = purple_fixture_add_account(username, "prpl-jabber");
+			g_free(username);
+		}
+		asis = g_list_append(asis, account_state_info_new(budget_accounts[i], enabled));
+	}
+
+	return asis;
+}
+
+static void
+prepare_load(gint entries)
+{
+	reset_model();
+	locations_model_add_location("Budget", budget_location(entries, TRUE));
+	locations_model_save();
+	locations_model_free();
+}
+
+static void
+run_load(void)
+{
+	locations_model_load();
+}
+
+static void
+prepare_save(gint entries)
+{
+	reset_model();
+	locations_model_add_location("Budget", budget_location(entries, TRUE));
+	locations_model_save();
+}
+
+static void
+run_save(void)
+{
+	locations_model_save();
+}
+
+static void
+prepare_switch(gint entries)
+{
+	reset_model();
+	locations_model_add_location("On", budget_location(entries, TRUE));
+	locations_model_add_location("Off", budget_location(entries, FALSE));
+	locations_switch_to("Off");
+}
+
+static void
+run_switch(void)
+{
+	/* Every account changes its state. */
+	locations_switch_to("On");
+}
+
+static const AllocBudget alloc_budgets[] =
+{
+	/*
+	 * operation, prepare, run, allocations and bytes per entry, fixed
+	 * allocations and bytes. Per entry, load copies the pref string and
+	 * its list node and allocates the AccountStateInfo and its node, the
+	 * account index grows with the accounts; save allocates the mapping
+	 * node and libpurple the pref copy and its node, the buffer doubles;
+	 * switch pays libpurple's "auto-login" setting, its ui string and its
+	 * key, about 3 allocations and 50 bytes. An account enabled for the
+	 * first time also gets its per-UI settings table, the copy of the UI
+	 * key and the table's arrays, about 6 allocations and 290 bytes more.
+	 * The small run enables accounts 0 to 49 first, so the large one
+	 * enables 200 new accounts: about 7.5 allocations and 268 bytes per
+	 * entry, and 75 allocations and 3600 bytes more fixed cost.
+	 */
+	{ "load",   prepare_load,   run_load,   4.1, 208,  32,  2048 },
+	{ "save",   prepare_save,   run_save,   3.1, 240,   8,  1024 },
+	{ "switch", prepare_switch, run_switch, 8.4, 320, 224, 12288 }
+};
+
+static AllocCount
+measure(const AllocBudget *budget, gint entries)
+{
+	budget->prepare(entries);
+	alloc_count_begin();
+	budget->run();
+	return alloc_count_end();
+}
+
+/* The cost extrapolated to an empty location, it may be negative. */
+static gdouble
+fixed_cost(guint64 small, guint64 large)
+{
+	return ((gdouble)small * BUDGET_LARGE - (gdouble)large * BUDGET_SMALL) /
+		(BUDGET_LARGE - BUDGET_SMALL);
+}
+
+static void
+test_alloc_budget(gconstpointer data)
+{
+	const AllocBudget *budget = data;
+	AllocCount small,
+			   large;
+	gdouble allocations = 0,
+			bytes = 0;
+
+	small = measure(budget, BUDGET_SMALL);
+	large = measure(budget, BUDGET_LARGE);
+
+	allocations = ((gdouble)large.allocations - small.allocations) / (BUDGET_LARGE - BUDGET_SMALL);
+	bytes = ((gdouble)large.bytes - small.bytes) / (BUDGET_LARGE - BUDGET_SMALL);
+
+	g_test_message("%s: %.2f allocations, %.2f bytes per entry, %.2f allocations, "
+			"%.2f bytes fixed", budget->operation,
+			allocations, bytes, fixed_cost(small.allocations, large.allocations),
+			fixed_cost(small.bytes, large.bytes));
+
+	g_assert_cmpfloat(allocations, <=, budget->allocations);
+	g_assert_cmpfloat(bytes, <=, budget->bytes);
+	g_assert_cmpfloat(fixed_cost(small.allocations, large.allocations), <=, budget->fixed_allocations);
+	g_assert_cmpfloat(fixed_cost(small.bytes, large.bytes), <=, budget->fixed_bytes);
+}
+
+#endif /* LOCATIONS_ALLOC_ACCOUNTING */
+
+int
+main(int argc, char *argv[])
+{
+	int result = 0;
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+	gchar *path = NULL;
+	guint i = 0;
+#endif
+
+	g_test_init(&argc, &argv, NULL);
+
+	purple_fixture_init();
+	locations_model_init();
+	locations_model_load();
+	locations_set_init();
+	locations_drift_init();
+	locations_switch_init();
+	locations_predict_init();
+	locations_predict_load();
+	resolver_stub_install();
+	locations_prewarm_init();
+	/* Predictions run from timers, the tests pre-warm explicitly */
+	purple_prefs_set_bool(PREF_PREWARM, FALSE);
+
+	g_test_add_func("/model/save-load-roundtrip", test_save_load_roundtrip);
+	g_test_add_func("/model/load-skips-bad-entries", test_load_skips_bad_entries);
+	g_test_add_func("/model/delete-location", test_delete_location);
+	g_test_add_func("/model/batched-mutations", test_batched_mutations);
+	g_test_add_func("/model/change-notifications", test_change_notifications);
+	g_test_add_func("/model/account-removed", test_account_removed);
+	g_test_add_func("/switch/applies-location", test_switch_applies_location);
+	g_test_add_func("/switch/location-status", test_location_status);
+	g_test_add_func("/switch/transaction", test_switch_transaction);
+	g_test_add_func("/switch/fallback-restores", test_switch_fallback_restores);
+	g_test_add_func("/switch/error-during-login", test_switch_error_during_login);
+	g_test_add_func("/set/union-intersect-override", test_set_union_intersect_override);
+	g_test_add_func("/set/switch-and-persist", test_set_switch_and_persist);
+	g_test_add_func("/drift/tracking", test_drift_tracking);
+	g_test_add_func("/drift/save-combined-set", test_drift_save_combined_set);
+	g_test_add_func("/predict/next-location", test_predict_next);
+	g_test_add_func("/prewarm/cache-bounds", test_prewarm_cache_bounds);
+	g_test_add_func("/prewarm/skips-proxied-accounts", test_prewarm_skips_proxied_accounts);
+	g_test_add_func("/prewarm/resolve-host", test_prewarm_resolve_host);
+	g_test_add_func("/prewarm/fallback-resolver", test_prewarm_fallback);
+
+#ifdef LOCATIONS_ALLOC_ACCOUNTING
+	for (i = 0; i < G_N_ELEMENTS(alloc_budgets); ++i)
+	{
+		path = g_strdup_printf("/alloc/%s", alloc_budgets[i].operation);
+		g_test_add_data_func(path, &alloc_budgets[i], test_alloc_budget);
+		g_free(path);
+	}
+#endif
+
+	result = g_test_run();
+
+	locations_prewarm_uninit();
+	locations_predict_uninit();
+	locations_switch_uninit();
+	locations_drift_uninit();
+	locations_set_uninit();
+	locations_model_free();
+	locations_model_uninit();
+	purple_fixture_uninit();
+
+	return result;
+}